@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Times each bench/*.lspy, or the ones named on the command line, at
+# every size on its "; sizes:" line. A benchmark defines (bench n); the
+# time shown is for loading the file and calling it, less the time to
+# load the file alone. MODE is passed to env, so MODE=LISPY_VM=off runs
+# them under the tree-walker.
+
+LISPY=${LISPY:-./main}
+tmp=${TMPDIR:-/tmp}/lispy-bench.$$.lspy
+
+now() {
+    date +%s%N
+}
+
+run() {
+    t=$(now)
+    env $MODE "$LISPY" "$tmp" > /dev/null 2>&1
+    echo $(( $(now) - t ))
+}
+
+for b in ${*:-bench/*.lspy}; do
+    cp "$b" "$tmp"
+    base=$(run)
+    for n in $(sed -n 's/^; sizes: *//p' "$b"); do
+        { cat "$b"; echo "(bench $n)"; } > "$tmp"
+        ns=$(( $(run) - base ))
+        printf "%-16s %10s %8d.%03d ms\n" "$(basename "$b" .lspy)" "$n" \
+            $((ns / 1000000)) $((ns / 1000 % 1000))
+    done
+done
+rm -f "$tmp"
@@ -0,0 +1,371 @@
+#include "lval.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define LARR_AVX2 1
+#endif
+
+/*
+ * Typed arrays keep their numbers unboxed in one block, so the builtins
+ * over them are plain loops. On x86-64 processors with AVX2 the loops
+ * run four lanes at a time; elsewhere, or with LISPY_SIMD=off, the
+ * scalar loops do the same work in the same order, so both give equal
+ * results, down to the rounding of double sums.
+ */
+int larr_simd = 1;
+
+#ifdef LARR_AVX2
+int larr_avx2(void) {
+    static int has = -1;
+    if (has < 0) { has = __builtin_cpu_supports("avx2") != 0; }
+    return larr_simd && has;
+}
+#else
+int larr_avx2(void) {
+    return 0;
+}
+#endif
+
+lval* lval_arr(int kind, int n) {
+    lval* v = lval_alloc();
+    v->type = LVAL_ARR;
+    v->ref = 1;
+    v->akind = kind;
+    v->acount = n;
+    v->ints = malloc(sizeof(long) * (n ? n : 1));
+    return v;
+}
+
+/* v as an array of doubles: v itself if it is one, else a converted copy. */
+lval* larr_f64(lval* v) {
+    if (v->akind == LARR_F64) { return lval_ref(v); }
+    lval* r = lval_arr(LARR_F64, v->acount);
+    for (int i = 0; i < v->acount; i++) { r->dbls[i] = v->ints[i]; }
+    return r;
+}
+
+/* A number holding s exactly, big if it does not fit in a long. */
+static lval* larr_int128(__int128 s) {
+    if (s >= LONG_MIN && s <= LONG_MAX) { return lval_num((long)s); }
+    lval* k = lval_num(1L << 32);
+    lval* r = lval_num((long)(s >> 64));
+    for (int shift = 32; shift >= 0; shift -= 32) {
+        lval* part = lval_num((long)((s >> shift) & 0xffffffff));
+        lval* p = lbig_arith('*', r, k);
+        lval_del(r);
+        r = lbig_arith('+', p, part);
+        lval_del(p);
+        lval_del(part);
+    }
+    lval_del(k);
+    return r;
+}
+
+/*
+ * Sums of doubles keep eight running totals, element i going to total
+ * i % 8, and add them up pairwise at the end. Two AVX2 registers hold
+ * the same eight totals.
+ */
+static double larr_fold8(double* s) {
+    double l[4];
+    for (int j = 0; j < 4; j++) { l[j] = s[j] + s[j+4]; }
+    return (l[0] + l[1]) + (l[2] + l[3]);
+}
+
+#ifdef LARR_AVX2
+__attribute__((target("avx2")))
+static void larr_sum_f64_avx2(double* x, int n, double* s) {
+    __m256d a = _mm256_setzero_pd();
+    __m256d b = _mm256_setzero_pd();
+    for (int i = 0; i + 8 <= n; i += 8) {
+        a = _mm256_add_pd(a, _mm256_loadu_pd(x + i));
+        b = _mm256_add_pd(b, _mm256_loadu_pd(x + i + 4));
+    }
+    _mm256_storeu_pd(s, a);
+    _mm256_storeu_pd(s + 4, b);
+}
+
+__attribute__((target("avx2")))
+static void larr_dot_f64_avx2(double* x, double* y, int n, double* s) {
+    __m256d a = _mm256_setzero_pd();
+    __m256d b = _mm256_setzero_pd();
+    for (int i = 0; i + 8 <= n; i += 8) {
+        a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    _mm256_storeu_pd(s, a);
+    _mm256_storeu_pd(s + 4, b);
+}
+
+/*
+ * Adds up the low and high 32 bits of each long apart, so no lane can
+ * overflow, and counts the negative ones to correct the high halves,
+ * which are taken unsigned.
+ */
+__attribute__((target("avx2")))
+static __int128 larr_sum_i64_avx2(long* x, int n) {
+    __m256i mask = _mm256_set1_epi64x(0xffffffff);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero;
+    __m256i hi = zero;
+    __m256i neg = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(x + i));
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v, mask));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v, 32));
+        neg = _mm256_sub_epi64(neg, _mm256_cmpgt_epi64(zero, v));
+    }
+    uint64_t l[4], h[4], m[4];
+    _mm256_storeu_si256((__m256i*)l, lo);
+    _mm256_storeu_si256((__m256i*)h, hi);
+    _mm256_storeu_si256((__m256i*)m, neg);
+
+    __int128 s = 0;
+    for (int j = 0; j < 4; j++) {
+        s += (__int128)l[j] + ((__int128)h[j] << 32) - ((__int128)m[j] << 64);
+    }
+    for (; i < n; i++) { s += x[i]; }
+    return s;
+}
+
+__attribute__((target("avx2")))
+static long larr_min_i64_avx2(long* x, int n, int max) {
+    __m256i m = _mm256_set1_epi64x(x[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(x + i));
+        __m256i gt = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+        m = _mm256_blendv_epi8(m, v, gt);
+    }
+    long l[4];
+    _mm256_storeu_si256((__m256i*)l, m);
+    long r = l[0];
+    for (int j = 1; j < 4; j++) {
+        if (max ? l[j] > r : l[j] < r) { r = l[j]; }
+    }
+    for (; i < n; i++) {
+        if (max ? x[i] > r : x[i] < r) { r = x[i]; }
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+static double larr_min_f64_avx2(double* x, int n, int max) {
+    __m256d m = _mm256_set1_pd(x[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        m = max ? _mm256_max_pd(v, m) : _mm256_min_pd(v, m);
+    }
+    double l[4];
+    _mm256_storeu_pd(l, m);
+    double r = l[0];
+    for (int j = 1; j < 4; j++) {
+        if (max ? l[j] > r : l[j] < r) { r = l[j]; }
+    }
+    for (; i < n; i++) {
+        if (max ? x[i] > r : x[i] < r) { r = x[i]; }
+    }
+    return r;
+}
+
+/* Returns whether any sum overflowed, checking the signs as it goes. */
+__attribute__((target("avx2")))
+static int larr_add_i64_avx2(long* x, long* y, int step, long* r, int n) {
+    __m256i over = _mm256_setzero_si256();
+    __m256i k = _mm256_set1_epi64x(y[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i*)(x + i));
+        __m256i b = step ? _mm256_loadu_si256((__m256i*)(y + i)) : k;
+        __m256i s = _mm256_add_epi64(a, b);
+        over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(s, a), _mm256_xor_si256(s, b)));
+        _mm256_storeu_si256((__m256i*)(r + i), s);
+    }
+    int o = _mm256_movemask_pd(_mm256_castsi256_pd(over)) != 0;
+    for (; i < n; i++) { o |= __builtin_add_overflow(x[i], y[i * step], &r[i]); }
+    return o;
+}
+
+__attribute__((target("avx2")))
+static void larr_add_f64_avx2(double* x, double* y, int step, double* r, int n) {
+    __m256d k = _mm256_set1_pd(y[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d b = step ? _mm256_loadu_pd(y + i) : k;
+        _mm256_storeu_pd(r + i, _mm256_add_pd(_mm256_loadu_pd(x + i), b));
+    }
+    for (; i < n; i++) { r[i] = x[i] + y[i * step]; }
+}
+#endif
+
+lval* larr_sum(lval* v) {
+    int n = v->acount;
+    if (v->akind == LARR_I64) {
+        __int128 s = 0;
+#ifdef LARR_AVX2
+        if (larr_avx2()) { return larr_int128(larr_sum_i64_avx2(v->ints, n)); }
+#endif
+        for (int i = 0; i < n; i++) { s += v->ints[i]; }
+        return larr_int128(s);
+    }
+
+    double s[8] = { 0 };
+    int i = n & ~7;
+#ifdef LARR_AVX2
+    if (larr_avx2()) {
+        larr_sum_f64_avx2(v->dbls, n, s);
+    } else
+#endif
+    for (int j = 0; j < i; j++) { s[j & 7] += v->dbls[j]; }
+    for (; i < n; i++) { s[i & 7] += v->dbls[i]; }
+    return lval_dbl(larr_fold8(s));
+}
+
+/*
+ * x and y have the same kind and length. Products of longs are summed
+ * in 128 bits, finishing in big numbers should even that overflow;
+ * AVX2 has no 64-bit multiply, so this part is scalar.
+ */
+lval* larr_dot(lval* x, lval* y) {
+    int n = x->acount;
+    if (x->akind == LARR_I64) {
+        __int128 s = 0;
+        for (int i = 0; i < n; i++) {
+            __int128 p = (__int128)x->ints[i] * y->ints[i];
+            __int128 t;
+            if (!__builtin_add_overflow(s, p, &t)) {
+                s = t;
+                continue;
+            }
+
+            lval* acc = larr_int128(s);
+            for (; i < n; i++) {
+                lval* a = lval_num(x->ints[i]);
+                lval* b = lval_num(y->ints[i]);
+                lval* q = lbig_arith('*', a, b);
+                lval* r = lbig_arith('+', acc, q);
+                lval_del(a);
+                lval_del(b);
+                lval_del(q);
+                lval_del(acc);
+                acc = r;
+            }
+            return acc;
+        }
+        return larr_int128(s);
+    }
+
+    double s[8] = { 0 };
+    int i = n & ~7;
+#ifdef LARR_AVX2
+    if (larr_avx2()) {
+        larr_dot_f64_avx2(x->dbls, y->dbls, n, s);
+    } else
+#endif
+    for (int j = 0; j < i; j++) { s[j & 7] += x->dbls[j] * y->dbls[j]; }
+    for (; i < n; i++) { s[i & 7] += x->dbls[i] * y->dbls[i]; }
+    return lval_dbl(larr_fold8(s));
+}
+
+/* The least element of v, or the greatest if max; v is not empty. */
+lval* larr_min(lval* v, int max) {
+    int n = v->acount;
+    if (v->akind == LARR_I64) {
+#ifdef LARR_AVX2
+        if (larr_avx2()) { return lval_num(larr_min_i64_avx2(v->ints, n, max)); }
+#endif
+        long r = v->ints[0];
+        for (int i = 1; i < n; i++) {
+            if (max ? v->ints[i] > r : v->ints[i] < r) { r = v->ints[i]; }
+        }
+        return lval_num(r);
+    }
+
+#ifdef LARR_AVX2
+    if (larr_avx2()) { return lval_dbl(larr_min_f64_avx2(v->dbls, n, max)); }
+#endif
+    double r = v->dbls[0];
+    for (int i = 1; i < n; i++) {
+        if (max ? v->dbls[i] > r : v->dbls[i] < r) { r = v->dbls[i]; }
+    }
+    return lval_dbl(r);
+}
+
+/*
+ * Adds y to x element by element, or adds y's one element to each of
+ * x's if step is 0. Both have the same kind. NULL if a long overflows.
+ */
+lval* larr_add(lval* x, lval* y, int step) {
+    int n = x->acount;
+    lval* r = lval_arr(x->akind, n);
+    if (x->akind == LARR_I64) {
+        int over = 0;
+#ifdef LARR_AVX2
+        if (larr_avx2()) {
+            over = larr_add_i64_avx2(x->ints, y->ints, step, r->ints, n);
+        } else
+#endif
+        for (int i = 0; i < n; i++) {
+            over |= __builtin_add_overflow(x->ints[i], y->ints[i * step], &r->ints[i]);
+        }
+        if (over) {
+            lval_del(r);
+            return NULL;
+        }
+        return r;
+    }
+
+#ifdef LARR_AVX2
+    if (larr_avx2()) {
+        larr_add_f64_avx2(x->dbls, y->dbls, step, r->dbls, n);
+        return r;
+    }
+#endif
+    for (int i = 0; i < n; i++) { r->dbls[i] = x->dbls[i] + y->dbls[i * step]; }
+    return r;
+}
+
+lval* larr_nth(lval* v, int i) {
+    return v->akind == LARR_I64 ? lval_num(v->ints[i]) : lval_dbl(v->dbls[i]);
+}
+
+int larr_eq(lval* x, lval* y) {
+    if (x->akind != y->akind || x->acount != y->acount) { return 0; }
+    if (x->akind == LARR_I64) {
+        return memcmp(x->ints, y->ints, sizeof(long) * x->acount) == 0;
+    }
+    for (int i = 0; i < x->acount; i++) {
+        if (x->dbls[i] != y->dbls[i]) { return 0; }
+    }
+    return 1;
+}
+
+unsigned larr_hash(lval* v) {
+    unsigned h = v->akind * 31 + v->acount;
+    for (int i = 0; i < v->acount; i++) {
+        uint64_t b;
+        if (v->akind == LARR_I64) {
+            b = v->ints[i];
+        } else {
+            double d = v->dbls[i] == 0 ? 0 : v->dbls[i];
+            memcpy(&b, &d, sizeof(b));
+        }
+        h = (h ^ (unsigned)b ^ (unsigned)(b >> 32)) * 16777619u;
+    }
+    return h;
+}
+
+void larr_print(lval* v) {
+    printf(v->akind == LARR_I64 ? "#i64[" : "#f64[");
+    for (int i = 0; i < v->acount; i++) {
+        if (i) { putchar(' '); }
+        if (v->akind == LARR_I64) {
+            printf("%li", v->ints[i]);
+        } else {
+            lval_print_dbl(v->dbls[i]);
+        }
+    }
+    putchar(']');
+}
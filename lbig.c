@@ -0,0 +1,362 @@
+#include "lval.h"
+
+/*
+ * Integers too big for a long are kept as a sign and a magnitude of
+ * 32-bit limbs, least significant first. Results that fit in a long
+ * again are always turned back into ordinary numbers, so a value has
+ * only one representation and lval_eq can compare limbs directly.
+ */
+
+#define LBIG_KARATSUBA 32
+
+typedef struct {
+    uint32_t* d;
+    int n;
+    int sign;
+    uint32_t buf[2];
+} lmag;
+
+static void lmag_of(lval* v, lmag* m) {
+    if (lval_type(v) == LVAL_BIG) {
+        m->d = v->limb;
+        m->n = v->nlimb;
+        m->sign = v->sign;
+        return;
+    }
+    long x = lval_long(v);
+    uint64_t u = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    m->buf[0] = (uint32_t)u;
+    m->buf[1] = (uint32_t)(u >> 32);
+    m->d = m->buf;
+    m->n = m->buf[1] ? 2 : m->buf[0] ? 1 : 0;
+    m->sign = x < 0 ? -1 : 1;
+}
+
+static lval* lbig_new(int n, int sign) {
+    lval* v = lval_alloc();
+    v->type = LVAL_BIG;
+    v->ref = 1;
+    v->limb = calloc(n ? n : 1, sizeof(uint32_t));
+    v->nlimb = n;
+    v->sign = sign;
+    return v;
+}
+
+/* Trims v and returns it as an ordinary number if it fits in a long. */
+static lval* lbig_norm(lval* v) {
+    while (v->nlimb && v->limb[v->nlimb-1] == 0) { v->nlimb--; }
+    if (v->nlimb > 2) { return v; }
+
+    uint64_t u = 0;
+    if (v->nlimb > 0) { u = v->limb[0]; }
+    if (v->nlimb > 1) { u |= (uint64_t)v->limb[1] << 32; }
+    if (v->sign > 0 && u > (uint64_t)LONG_MAX) { return v; }
+    if (v->sign < 0 && u > (uint64_t)LONG_MAX + 1) { return v; }
+
+    long x = v->sign > 0 ? (long)u : (long)(0 - u);
+    lval_del(v);
+    return lval_num(x);
+}
+
+static int mag_cmp(uint32_t* a, int na, uint32_t* b, int nb) {
+    while (na && a[na-1] == 0) { na--; }
+    while (nb && b[nb-1] == 0) { nb--; }
+    if (na != nb) { return na < nb ? -1 : 1; }
+    for (int i = na - 1; i >= 0; i--) {
+        if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+    }
+    return 0;
+}
+
+/* r[0..rn) += x[0..xn), carrying as far as r goes. */
+static void mag_add_into(uint32_t* r, int rn, uint32_t* x, int xn) {
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < xn; i++) {
+        carry += (uint64_t)r[i] + x[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+}
+
+/* r[0..rn) -= x[0..xn), which must not be larger. */
+static void mag_sub_into(uint32_t* r, int rn, uint32_t* x, int xn) {
+    int64_t borrow = 0;
+    int i = 0;
+    for (; i < xn; i++) {
+        borrow += (int64_t)r[i] - x[i];
+        r[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    for (; borrow && i < rn; i++) {
+        borrow += r[i];
+        r[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+}
+
+static void mag_mul_school(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* r) {
+    memset(r, 0, sizeof(uint32_t) * (na + nb));
+    for (int i = 0; i < na; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < nb; j++) {
+            carry += (uint64_t)a[i] * b[j] + r[i+j];
+            r[i+j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i+nb] = (uint32_t)carry;
+    }
+}
+
+/*
+ * r[0..na+nb) = a * b. Above LBIG_KARATSUBA limbs both halves are
+ * multiplied with three recursive products instead of four:
+ * (a1 B + a0)(b1 B + b0) = z2 B^2 + ((a0 + a1)(b0 + b1) - z2 - z0) B + z0.
+ * A much longer a is cut into pieces the size of b first.
+ */
+static void mag_mul(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* r) {
+    if (na < nb) {
+        uint32_t* t = a; a = b; b = t;
+        int n = na; na = nb; nb = n;
+    }
+    if (nb < LBIG_KARATSUBA) {
+        mag_mul_school(a, na, b, nb, r);
+        return;
+    }
+
+    if (2 * nb <= na) {
+        memset(r, 0, sizeof(uint32_t) * (na + nb));
+        uint32_t* t = malloc(sizeof(uint32_t) * 2 * nb);
+        for (int off = 0; off < na; off += nb) {
+            int len = na - off < nb ? na - off : nb;
+            mag_mul(a + off, len, b, nb, t);
+            mag_add_into(r + off, na + nb - off, t, len + nb);
+        }
+        free(t);
+        return;
+    }
+
+    int m = (na + 1) / 2;
+    int n1 = na - m;
+    int m1 = nb - m;
+
+    uint32_t* sa = calloc(m + 1, sizeof(uint32_t));
+    uint32_t* sb = calloc(m + 1, sizeof(uint32_t));
+    memcpy(sa, a, sizeof(uint32_t) * m);
+    memcpy(sb, b, sizeof(uint32_t) * m);
+    mag_add_into(sa, m + 1, a + m, n1);
+    mag_add_into(sb, m + 1, b + m, m1);
+
+    uint32_t* z1 = malloc(sizeof(uint32_t) * (2 * m + 2));
+    mag_mul(sa, m + 1, sb, m + 1, z1);
+
+    memset(r, 0, sizeof(uint32_t) * (na + nb));
+    mag_mul(a, m, b, m, r);
+    uint32_t* z2 = r + 2 * m;
+    if (m1 > 0) { mag_mul(a + m, n1, b + m, m1, z2); }
+
+    mag_sub_into(z1, 2 * m + 2, r, 2 * m);
+    if (m1 > 0) { mag_sub_into(z1, 2 * m + 2, z2, n1 + m1); }
+    int n = na + nb - m < 2 * m + 2 ? na + nb - m : 2 * m + 2;
+    mag_add_into(r + m, na + nb - m, z1, n);
+
+    free(sa);
+    free(sb);
+    free(z1);
+}
+
+/* q = a / d for a single limb d, returning the remainder. */
+static uint32_t mag_div1(uint32_t* a, int na, uint32_t d, uint32_t* q) {
+    uint64_t rem = 0;
+    for (int i = na - 1; i >= 0; i--) {
+        rem = (rem << 32) | a[i];
+        q[i] = (uint32_t)(rem / d);
+        rem %= d;
+    }
+    return (uint32_t)rem;
+}
+
+/* q[0..na-nb+1) = a / b by long division (Knuth, algorithm D), na >= nb >= 2. */
+static void mag_div(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* q) {
+    int s = __builtin_clz(b[nb-1]);
+    uint32_t* u = calloc(na + 1, sizeof(uint32_t));
+    uint32_t* v = calloc(nb, sizeof(uint32_t));
+    for (int i = nb - 1; i > 0; i--) {
+        v[i] = (b[i] << s) | (s ? (uint32_t)((uint64_t)b[i-1] >> (32 - s)) : 0);
+    }
+    v[0] = b[0] << s;
+    u[na] = s ? (uint32_t)((uint64_t)a[na-1] >> (32 - s)) : 0;
+    for (int i = na - 1; i > 0; i--) {
+        u[i] = (a[i] << s) | (s ? (uint32_t)((uint64_t)a[i-1] >> (32 - s)) : 0);
+    }
+    u[0] = a[0] << s;
+
+    for (int j = na - nb; j >= 0; j--) {
+        uint64_t top = ((uint64_t)u[j+nb] << 32) | u[j+nb-1];
+        uint64_t qhat = top / v[nb-1];
+        uint64_t rhat = top % v[nb-1];
+        while (qhat >> 32 || qhat * v[nb-2] > ((rhat << 32) | u[j+nb-2])) {
+            qhat--;
+            rhat += v[nb-1];
+            if (rhat >> 32) { break; }
+        }
+
+        int64_t borrow = 0;
+        uint64_t carry = 0;
+        for (int i = 0; i < nb; i++) {
+            carry += qhat * v[i];
+            borrow += (int64_t)u[i+j] - (uint32_t)carry;
+            u[i+j] = (uint32_t)borrow;
+            carry >>= 32;
+            borrow >>= 32;
+        }
+        borrow += (int64_t)u[j+nb] - (uint32_t)carry;
+        u[j+nb] = (uint32_t)borrow;
+
+        if (borrow < 0) {
+            qhat--;
+            mag_add_into(u + j, nb + 1, v, nb);
+        }
+        q[j] = (uint32_t)qhat;
+    }
+
+    free(u);
+    free(v);
+}
+
+static lval* lbig_addsub(lmag* x, lmag* y, int ysign) {
+    int xsign = x->n ? x->sign : ysign;
+    if (!y->n) { ysign = xsign; }
+
+    if (xsign == ysign) {
+        int n = (x->n > y->n ? x->n : y->n) + 1;
+        lval* r = lbig_new(n, xsign);
+        memcpy(r->limb, x->d, sizeof(uint32_t) * x->n);
+        mag_add_into(r->limb, n, y->d, y->n);
+        return lbig_norm(r);
+    }
+
+    if (mag_cmp(x->d, x->n, y->d, y->n) < 0) {
+        lmag* t = x; x = y; y = t;
+        xsign = ysign;
+    }
+    lval* r = lbig_new(x->n, xsign);
+    memcpy(r->limb, x->d, sizeof(uint32_t) * x->n);
+    mag_sub_into(r->limb, x->n, y->d, y->n);
+    return lbig_norm(r);
+}
+
+/* Applies + - * or / to the numbers x and y, either of which may be big. */
+lval* lbig_arith(int op, lval* x, lval* y) {
+    lmag a, b;
+    lmag_of(x, &a);
+    lmag_of(y, &b);
+
+    switch (op) {
+        case '+': return lbig_addsub(&a, &b, b.sign);
+        case '-': return lbig_addsub(&a, &b, -b.sign);
+        case '*': {
+            lval* r = lbig_new(a.n + b.n, a.sign * b.sign);
+            if (a.n && b.n) { mag_mul(a.d, a.n, b.d, b.n, r->limb); }
+            return lbig_norm(r);
+        }
+    }
+
+    if (mag_cmp(a.d, a.n, b.d, b.n) < 0) { return lval_num(0); }
+    lval* r = lbig_new(a.n - b.n + 1, a.sign * b.sign);
+    if (b.n == 1) {
+        mag_div1(a.d, a.n, b.d[0], r->limb);
+    } else {
+        mag_div(a.d, a.n, b.d, b.n, r->limb);
+    }
+    return lbig_norm(r);
+}
+
+int lbig_cmp(lval* x, lval* y) {
+    if (lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_NUM) {
+        return (lval_long(x) > lval_long(y)) - (lval_long(x) < lval_long(y));
+    }
+    lmag a, b;
+    lmag_of(x, &a);
+    lmag_of(y, &b);
+    if (a.n == 0) { a.sign = 1; }
+    if (b.n == 0) { b.sign = 1; }
+    if (a.sign != b.sign) { return a.sign < b.sign ? -1 : 1; }
+    return a.sign * mag_cmp(a.d, a.n, b.d, b.n);
+}
+
+double lbig_dbl(lval* v) {
+    double d = 0;
+    for (int i = v->nlimb - 1; i >= 0; i--) { d = d * 4294967296.0 + v->limb[i]; }
+    return v->sign * d;
+}
+
+/*
+ * Finishes the arithmetic builtin op on the arguments a from index i on,
+ * with acc the result so far, once a long can no longer hold it.
+ */
+lval* lbig_fold(lval* a, int op, int i, lval* acc) {
+    for (; i < a->count; i++) {
+        if (op == '/' && lval_type(a->cell[i]) == LVAL_NUM && lval_long(a->cell[i]) == 0) {
+            lval_del(acc);
+            lval_del(a);
+            return lval_err("Division By Zero!");
+        }
+        lval* r = lbig_arith(op, acc, a->cell[i]);
+        lval_del(acc);
+        acc = r;
+    }
+    lval_del(a);
+    return acc;
+}
+
+lval* lbig_read(char* s) {
+    int sign = 1;
+    if (*s == '-') { sign = -1; s++; }
+
+    int len = strlen(s);
+    lval* v = lbig_new(len / 9 + 2, sign);
+    v->nlimb = 0;
+    for (int i = 0; i < len;) {
+        int k = (len - i) % 9 ? (len - i) % 9 : 9;
+        uint32_t chunk = 0;
+        uint32_t scale = 1;
+        for (int j = 0; j < k; j++, i++) {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        uint64_t carry = chunk;
+        for (int j = 0; j < v->nlimb; j++) {
+            carry += (uint64_t)v->limb[j] * scale;
+            v->limb[j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) { v->limb[v->nlimb++] = (uint32_t)carry; }
+    }
+    return lbig_norm(v);
+}
+
+void lbig_print(lval* v) {
+    int n = v->nlimb;
+    uint32_t* q = malloc(sizeof(uint32_t) * n);
+    uint32_t* chunks = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+    memcpy(q, v->limb, sizeof(uint32_t) * n);
+
+    int count = 0;
+    do {
+        chunks[count++] = mag_div1(q, n, 1000000000, q);
+        while (n && q[n-1] == 0) { n--; }
+    } while (n);
+
+    if (v->sign < 0) { putchar('-'); }
+    printf("%u", chunks[count-1]);
+    for (int i = count - 2; i >= 0; i--) { printf("%09u", chunks[i]); }
+
+    free(q);
+    free(chunks);
+}
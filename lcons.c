@@ -0,0 +1,216 @@
+#include "lval.h"
+
+int lcons_enabled = 0;
+
+/*
+ * With hash-consing on, strings and lists read from source or bound
+ * globally are replaced by the one copy of their value in this table,
+ * so equal values share memory and are compared by address. The table
+ * does not hold references: a value leaves it when it is freed. Values
+ * in it are never changed in place, since lval_unshare copies them.
+ *
+ * Open addressing with linear probing; the hash kept in each value
+ * lets entries be moved back on removal instead of leaving tombstones.
+ */
+static lval** lcons_table = NULL;
+static int lcons_cap = 0;
+static int lcons_count = 0;
+
+static int lcons_kind(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return 0; }
+    return v->type == LVAL_STR || v->type == LVAL_SEXPR || v->type == LVAL_QEXPR;
+}
+
+static unsigned lcons_hash_of(lval* v) {
+    return v->type == LVAL_STR ? v->strhash : v->hash;
+}
+
+/*
+ * Lists hash from the hashes of their children, which are already in
+ * the table if they are lists or strings themselves.
+ */
+static unsigned lcons_hash(lval* v) {
+    unsigned h;
+    if (v->type == LVAL_STR) {
+        h = lval_hash(v);
+    } else {
+        h = (2166136261u ^ v->type) * 16777619u;
+        h = (h ^ v->count) * 16777619u;
+        for (int i = 0; i < v->count; i++) {
+            lval* c = v->cell[i];
+            h = (h ^ (lval_consed(c) ? lcons_hash_of(c) : lval_hash(c))) * 16777619u;
+        }
+        h ^= h >> 15;
+        h *= 0x2c1b3c6du;
+        h ^= h >> 12;
+    }
+    return h ? h : 1;
+}
+
+/*
+ * Whether two children are the same value, which is stricter than ==:
+ * a number and a double, or 0.0 and -0.0, are equal but print apart, so
+ * doubles compare by their bits. Vectors, maps and functions may hold
+ * such doubles deep inside and only match themselves.
+ */
+static int lcons_exact(lval* x, lval* y) {
+    if (x == y) { return 1; }
+    int t = lval_type(x);
+    if (t != lval_type(y)) { return 0; }
+    switch (t) {
+        case LVAL_NUM: return lval_long(x) == lval_long(y);
+        case LVAL_DBL: {
+            double p = lval_double(x);
+            double q = lval_double(y);
+            return memcmp(&p, &q, sizeof(double)) == 0;
+        }
+        case LVAL_BIG:
+            return x->sign == y->sign && x->nlimb == y->nlimb
+                && memcmp(x->limb, y->limb, sizeof(uint32_t) * x->nlimb) == 0;
+        case LVAL_ARR:
+            return x->akind == y->akind && x->acount == y->acount
+                && memcmp(x->ints, y->ints, sizeof(long) * x->acount) == 0;
+        case LVAL_MAT:
+            return x->rows == y->rows && x->cols == y->cols
+                && memcmp(x->mat, y->mat, sizeof(double) * x->rows * x->cols) == 0;
+        case LVAL_SYM: return x->sym == y->sym;
+        case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+    }
+    return 0;
+}
+
+/*
+ * The children of both lists are interned already, so strings and lists
+ * among them are the same only when they are the same copy.
+ */
+static int lcons_same(lval* x, lval* y) {
+    if (x->type != y->type) { return 0; }
+    if (x->type == LVAL_STR) { return strcmp(x->str, y->str) == 0; }
+    if (x->count != y->count) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        lval* a = x->cell[i];
+        lval* b = y->cell[i];
+        if (a == b) { continue; }
+        if (lcons_kind(a) || !lcons_exact(a, b)) { return 0; }
+    }
+    return 1;
+}
+
+static void lcons_grow(void) {
+    lval** old = lcons_table;
+    int cap = lcons_cap;
+    lcons_cap = cap ? cap * 2 : 1024;
+    lcons_table = calloc(lcons_cap, sizeof(lval*));
+    for (int i = 0; i < cap; i++) {
+        if (!old[i]) { continue; }
+        int j = lcons_hash_of(old[i]) & (lcons_cap - 1);
+        while (lcons_table[j]) { j = (j + 1) & (lcons_cap - 1); }
+        lcons_table[j] = old[i];
+    }
+    free(old);
+}
+
+/* Returns the copy in the table equal to v, adding v if there is none. */
+static lval* lcons_intern(lval* v) {
+    if (2 * (lcons_count + 1) > lcons_cap) { lcons_grow(); }
+
+    unsigned h = lcons_hash(v);
+    int i = h & (lcons_cap - 1);
+    for (; lcons_table[i]; i = (i + 1) & (lcons_cap - 1)) {
+        lval* c = lcons_table[i];
+        if (lcons_hash_of(c) == h && lcons_same(c, v)) {
+            lval_ref(c);
+            lval_del(v);
+            return c;
+        }
+    }
+
+    if (v->type == LVAL_STR) {
+        v->strhash = h;
+    } else {
+        v->hash = h;
+    }
+    lcons_table[i] = v;
+    lcons_count++;
+    return v;
+}
+
+void lcons_forget(lval* v) {
+    int mask = lcons_cap - 1;
+    int i = lcons_hash_of(v) & mask;
+    while (lcons_table[i] != v) { i = (i + 1) & mask; }
+
+    /* pull later entries of the same run back over the gap */
+    for (int j = (i + 1) & mask; lcons_table[j]; j = (j + 1) & mask) {
+        int home = lcons_hash_of(lcons_table[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            lcons_table[i] = lcons_table[j];
+            i = j;
+        }
+    }
+    lcons_table[i] = NULL;
+    lcons_count--;
+}
+
+typedef struct {
+    lval* v;
+    lval* x;
+    int i;
+} lconsf;
+
+static lconsf* lcons_stack = NULL;
+static int lcons_stack_count = 0;
+static int lcons_stack_cap = 0;
+
+static void lcons_push(lval* v) {
+    if (lcons_stack_count == lcons_stack_cap) {
+        lcons_stack_cap = lcons_stack_cap ? lcons_stack_cap * 2 : 64;
+        lcons_stack = realloc(lcons_stack, sizeof(lconsf) * lcons_stack_cap);
+    }
+    lcons_stack[lcons_stack_count++] = (lconsf){ v, NULL, 0 };
+}
+
+/*
+ * Returns the shared copy of v, consuming v. Lists are interned after
+ * their children, from a stack on the heap; a list whose children were
+ * replaced is interned as a fresh copy rather than changed, since v may
+ * be held elsewhere.
+ */
+lval* lval_cons(lval* v) {
+    if (!lcons_enabled || !lcons_kind(v) || lval_consed(v)) { return v; }
+
+    int base = lcons_stack_count;
+    lcons_push(v);
+    lval* r = NULL;
+
+    for (;;) {
+        lconsf* f = &lcons_stack[lcons_stack_count-1];
+        if (r) {
+            lval* c = f->v->cell[f->i-1];
+            if (r == c) {
+                lval_del(r);
+            } else {
+                if (!f->x) { f->x = lval_copy(f->v); }
+                lval_del(f->x->cell[f->i-1]);
+                f->x->cell[f->i-1] = r;
+            }
+            r = NULL;
+        }
+
+        if (f->v->type != LVAL_STR && f->i < f->v->count) {
+            lval* c = f->v->cell[f->i++];
+            if (lcons_kind(c) && !lval_consed(c)) { lcons_push(lval_ref(c)); }
+            continue;
+        }
+
+        if (f->x) {
+            lval_del(f->v);
+            r = lcons_intern(f->x);
+        } else {
+            r = lcons_intern(f->v);
+        }
+        if (--lcons_stack_count == base) { break; }
+    }
+
+    return r;
+}
@@ -0,0 +1,707 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+
+#include "lval.h"
+
+#define LGC_THRESHOLD 10000
+#define LGC_YOUNG 2000
+#define LGC_MINORS 8
+
+#define LSLAB_SIZE (64 * 1024)
+#define LCELL_CHUNK (16 * 1024)
+
+#define LBLOCK_SIZE (256 * 1024)
+#define LBLOCK_HEADER ((sizeof(lblock) + 15) & ~(size_t)15)
+#define LBLOCK_SLOT ((sizeof(lval) + 15) & ~(size_t)15)
+#define LBLOCK_SLOTS ((LBLOCK_SIZE - LBLOCK_HEADER) / LBLOCK_SLOT)
+
+#define LARENA_BLOCKS 8
+
+typedef struct lblock lblock;
+
+struct lblock {
+    int live;
+    char* bump;
+    char* end;
+    lval* free;
+    lblock* prev;
+    lblock* next;
+};
+
+lgc lgc_young = { &lgc_young, &lgc_young, 0, 0, 0, 0 };
+lgc lgc_old = { &lgc_old, &lgc_old, 0, 0, 0, 1 };
+int lgc_live = 0;
+int lgc_allocs = 0;
+int lgc_threshold = LGC_THRESHOLD;
+int lgc_mode = LGC_MARKSWEEP;
+int lgc_forms = 0;
+
+static int lgc_form_blocks = 0;
+
+static int lgc_minors = 0;
+static char lgc_gen = 1;
+
+static lgc** lgc_stack = NULL;
+static int lgc_stack_count = 0;
+static int lgc_stack_cap = 0;
+
+static lblock* lgc_nursery = NULL;
+static lblock* lgc_spare = NULL;
+static lblock* lgc_retired = NULL;
+
+static __thread lval* lslab_free = NULL;
+static __thread char* lslab_bump = NULL;
+static __thread char* lslab_end = NULL;
+
+static __thread lenv* lenv_free_list = NULL;
+
+static __thread lval** lcell_free_list[LCELL_CLASSES];
+static __thread char* lcell_bump[LCELL_CLASSES];
+static __thread char* lcell_end[LCELL_CLASSES];
+
+__thread lmem_stats lmem;
+
+void lgc_init(int mode) {
+    lgc_mode = mode;
+    lgc_threshold = mode == LGC_GENERATIONAL ? LGC_YOUNG : LGC_THRESHOLD;
+}
+
+static lblock* lblock_of(void* p) {
+    return (lblock*)((uintptr_t)p & ~(uintptr_t)(LBLOCK_SIZE - 1));
+}
+
+static lblock* lblock_new(void) {
+    lblock* b = lgc_spare;
+    if (b) {
+        lgc_spare = NULL;
+    } else if (posix_memalign((void**)&b, LBLOCK_SIZE, LBLOCK_SIZE) != 0) {
+        return NULL;
+    }
+    b->live = 0;
+    b->bump = (char*)b + LBLOCK_HEADER;
+    b->end = (char*)b + LBLOCK_SIZE;
+    b->free = NULL;
+    return b;
+}
+
+static void lblock_reset(lblock* b) {
+    b->bump = (char*)b + LBLOCK_HEADER;
+    b->free = NULL;
+}
+
+static void lblock_retire(lblock* b) {
+    b->prev = NULL;
+    b->next = lgc_retired;
+    if (lgc_retired) { lgc_retired->prev = b; }
+    lgc_retired = b;
+}
+
+static void lblock_unretire(lblock* b) {
+    if (b->prev) { b->prev->next = b->next; } else { lgc_retired = b->next; }
+    if (b->next) { b->next->prev = b->prev; }
+}
+
+/* A retired block at least half free if there is one, else a new block. */
+static lblock* lblock_next(void) {
+    for (lblock* b = lgc_retired; b; b = b->next) {
+        if (b->live <= (int)LBLOCK_SLOTS / 2) {
+            lblock_unretire(b);
+            return b;
+        }
+    }
+    return lblock_new();
+}
+
+static void lblock_del(lblock* b) {
+    if (!lgc_spare) {
+        lgc_spare = b;
+    } else {
+        free(b);
+    }
+}
+
+/*
+ * Heap lval nodes are carved out of 64K slabs and recycled through a
+ * free list threaded through their first word, so that constructing and
+ * dropping temporaries does not go through malloc and nodes allocated
+ * together stay close in memory.
+ */
+static lval* lval_alloc_heap(void) {
+    lval* v = lslab_free;
+    if (v) {
+        lslab_free = *(lval**)v;
+    } else {
+        if (lslab_bump + sizeof(lval) > lslab_end) {
+            lslab_bump = malloc(LSLAB_SIZE);
+            lslab_end = lslab_bump + LSLAB_SIZE;
+            lmem.slabs++;
+        }
+        v = (lval*)lslab_bump;
+        lslab_bump += sizeof(lval);
+    }
+    v->gc.block = 0;
+    return v;
+}
+
+static void lval_free_heap(lval* v) {
+    *(lval**)v = lslab_free;
+    lslab_free = v;
+}
+
+/*
+ * Every call makes a frame, so dead environments are kept for reuse
+ * together with their binding arrays.
+ */
+lenv* lenv_alloc(void) {
+    lenv* e = lenv_free_list;
+    if (e) {
+        lenv_free_list = e->par;
+        return e;
+    }
+
+    e = malloc(sizeof(lenv));
+    e->cap = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    return e;
+}
+
+void lenv_free(lenv* e) {
+    e->par = lenv_free_list;
+    lenv_free_list = e;
+}
+
+static int lcell_class(int n) {
+    int k = 0;
+    while ((1 << k) < n) { k++; }
+    return k;
+}
+
+/*
+ * Cell arrays are rounded up to a power of two and, up to 128 entries,
+ * served from per-size free lists. Their size class follows from the
+ * element count, so callers pass the count they allocated with.
+ */
+lval** lcell_alloc(int n) {
+    if (n == 0) { return NULL; }
+
+    int k = lcell_class(n);
+    if (k >= LCELL_CLASSES) {
+        lmem.cells_large++;
+        return malloc(sizeof(lval*) << k);
+    }
+
+    lmem.cells[k]++;
+    lval** c = lcell_free_list[k];
+    if (c) {
+        lcell_free_list[k] = (lval**)c[0];
+        return c;
+    }
+
+    size_t size = sizeof(lval*) << k;
+    if (lcell_bump[k] + size > lcell_end[k]) {
+        lcell_bump[k] = malloc(LCELL_CHUNK);
+        lcell_end[k] = lcell_bump[k] + LCELL_CHUNK;
+    }
+    c = (lval**)lcell_bump[k];
+    lcell_bump[k] += size;
+    return c;
+}
+
+void lcell_free(lval** c, int n) {
+    if (n == 0) { return; }
+
+    int k = lcell_class(n);
+    if (k >= LCELL_CLASSES) {
+        free(c);
+        return;
+    }
+
+    lmem.cells_freed[k]++;
+    c[0] = (lval*)lcell_free_list[k];
+    lcell_free_list[k] = c;
+}
+
+lval** lcell_realloc(lval** c, int n, int m) {
+    if (n && m && lcell_class(n) == lcell_class(m)) { return c; }
+    if (lcell_class(n) >= LCELL_CLASSES && lcell_class(m) >= LCELL_CLASSES) {
+        return realloc(c, sizeof(lval*) << lcell_class(m));
+    }
+
+    lval** x = lcell_alloc(m);
+    if (x && c) { memcpy(x, c, sizeof(lval*) * (n < m ? n : m)); }
+    lcell_free(c, n);
+    return x;
+}
+
+/*
+ * In generational mode, and in arena mode while a top-level form is
+ * being evaluated, lval nodes are bump allocated from a nursery block.
+ * A block is reset in one shot once everything in it has died. Nodes
+ * on the C stack are referenced by raw pointers, so survivors cannot be
+ * moved out; instead a block that fills up while some are alive is
+ * retired, and the slots that die in it go on the block's free list.
+ * Once at least half of a retired block is free it can become the
+ * nursery again, so a few long-lived nodes never hold more than about
+ * twice their own size.
+ */
+lval* lval_alloc(void) {
+    lmem.nodes++;
+    if (lgc_mode == LGC_MARKSWEEP) { return lval_alloc_heap(); }
+    if (lgc_mode == LGC_ARENA && !lgc_forms) { return lval_alloc_heap(); }
+
+    lblock* b = lgc_nursery;
+    if (!b || (!b->free && b->bump + LBLOCK_SLOT > b->end)) {
+        if (b && b->live == 0) {
+            lblock_reset(b);
+        } else {
+            if (lgc_mode == LGC_ARENA && lgc_form_blocks == LARENA_BLOCKS) {
+                return lval_alloc_heap();
+            }
+            if (b) { lblock_retire(b); }
+            b = lgc_nursery = lblock_next();
+            if (!b) { return lval_alloc_heap(); }
+            lgc_form_blocks++;
+        }
+    }
+
+    lval* v = b->free;
+    if (v) {
+        b->free = *(lval**)v;
+    } else {
+        v = (lval*)b->bump;
+        b->bump += LBLOCK_SLOT;
+    }
+    b->live++;
+    v->gc.block = 1;
+    return v;
+}
+
+void lval_free(lval* v) {
+    lmem.nodes_freed++;
+    if (!v->gc.block) { lval_free_heap(v); return; }
+
+    lblock* b = lblock_of(v);
+    if (--b->live == 0) {
+        if (b == lgc_nursery) {
+            lblock_reset(b);
+        } else {
+            lblock_unretire(b);
+            lblock_del(b);
+        }
+        return;
+    }
+    *(lval**)v = b->free;
+    b->free = v;
+}
+
+int lval_traced(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return 0; }
+
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return 1;
+        case LVAL_FUN:
+            return v->buildtin == NULL;
+    }
+    return 0;
+}
+
+static void lgc_link(lgc* list, lgc* g) {
+    g->next = list->next;
+    g->prev = list;
+    list->next->prev = g;
+    list->next = g;
+}
+
+static void lgc_unlink(lgc* g) {
+    g->prev->next = g->next;
+    g->next->prev = g->prev;
+}
+
+void lgc_track(lgc* g, int kind) {
+    g->kind = kind;
+    g->mark = 0;
+    if (lgc_mode == LGC_GENERATIONAL) {
+        g->gen = 0;
+        lgc_link(&lgc_young, g);
+    } else {
+        g->gen = 1;
+        lgc_link(&lgc_old, g);
+    }
+    lgc_live++;
+    lgc_allocs++;
+}
+
+void lgc_untrack(lgc* g) {
+    lgc_unlink(g);
+    lgc_live--;
+}
+
+static int* lgc_ref(lgc* g) {
+    if (g->kind == LGC_LENV) { return &((lenv*)g)->ref; }
+    return &((lval*)g)->ref;
+}
+
+static void lgc_push(lgc* g) {
+    if (lgc_stack_count == lgc_stack_cap) {
+        lgc_stack_cap = lgc_stack_cap ? lgc_stack_cap * 2 : 256;
+        lgc_stack = realloc(lgc_stack, sizeof(lgc*) * lgc_stack_cap);
+    }
+    lgc_stack[lgc_stack_count++] = g;
+}
+
+/* Calls fn on every traced object directly referenced by g. */
+static void lgc_children(lgc* g, void (*fn)(lgc*)) {
+    if (g->kind == LGC_LENV) {
+        lenv* e = (lenv*)g;
+        if (e->par) { fn(&e->par->gc); }
+        for (int i = 0; i < e->count; i++) {
+            if (lval_traced(e->vals[i])) { fn(&e->vals[i]->gc); }
+        }
+        return;
+    }
+
+    lval* v = (lval*)g;
+    if (v->type == LVAL_FUN) {
+        fn(&v->env->gc);
+        fn(&v->formals->gc);
+        fn(&v->body->gc);
+        return;
+    }
+    if (v->base) {
+        fn(&v->base->gc);
+        return;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i] && lval_traced(v->cell[i])) { fn(&v->cell[i]->gc); }
+    }
+}
+
+static void lgc_unref(lgc* g) {
+    if (g->gen == lgc_gen) { g->refs--; }
+}
+
+static void lgc_mark(lgc* g) {
+    if (g->gen != lgc_gen || g->mark) { return; }
+    g->mark = 1;
+    lgc_push(g);
+}
+
+/* Drops every reference g holds without freeing g itself. */
+static void lgc_clear(lgc* g) {
+    if (g->kind == LGC_LENV) {
+        lenv* e = (lenv*)g;
+        if (e->par) { lenv_del(e->par); }
+        for (int i = 0; i < e->count; i++) {
+            if (e->top != e) { LSYM(e->syms[i])->frames--; }
+            lval_del(e->vals[i]);
+        }
+        free(e->index);
+        e->par = NULL;
+        e->count = 0;
+        return;
+    }
+
+    lval* v = (lval*)g;
+    if (v->type == LVAL_FUN) {
+        lenv_del(v->env);
+        lval_del(v->formals);
+        lval_del(v->body);
+        return;
+    }
+    if (v->hash) {
+        lcons_forget(v);
+        v->hash = 0;
+    }
+    if (v->code) {
+        lvm_free(v->code);
+        v->code = NULL;
+    }
+    if (v->base) {
+        lval_del(v->base);
+        v->base = NULL;
+        v->count = 0;
+        return;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]) { lval_del(v->cell[i]); }
+    }
+    lcell_free(v->cell, v->count);
+    v->count = 0;
+}
+
+/*
+ * Reference counting frees everything except cycles, so the collector
+ * only has to find objects that are kept alive by each other. An object
+ * whose count is not fully explained by references from other objects
+ * in the generation being collected is held from outside it (the global
+ * environment, a value or frame on the evaluator's C stack, or an object
+ * in an older generation) and is a root; everything not reachable from
+ * a root is garbage.
+ */
+static int lgc_collect_gen(lgc* list, char gen) {
+    lgc* g;
+    lgc_gen = gen;
+
+    for (g = list->next; g != list; g = g->next) {
+        g->refs = *lgc_ref(g);
+        g->mark = 0;
+    }
+    for (g = list->next; g != list; g = g->next) {
+        lgc_children(g, lgc_unref);
+    }
+    for (g = list->next; g != list; g = g->next) {
+        if (g->refs > 0) { lgc_mark(g); }
+    }
+    while (lgc_stack_count) {
+        lgc_children(lgc_stack[--lgc_stack_count], lgc_mark);
+    }
+
+    lgc garbage = { &garbage, &garbage, 0, 0, 0, gen };
+    int freed = 0;
+    for (g = list->next; g != list;) {
+        lgc* next = g->next;
+        if (!g->mark) {
+            lgc_unlink(g);
+            lgc_link(&garbage, g);
+            (*lgc_ref(g))++;
+            freed++;
+        }
+        g = next;
+    }
+
+    for (g = garbage.next; g != &garbage; g = g->next) {
+        lgc_clear(g);
+    }
+    for (g = garbage.next; g != &garbage;) {
+        lgc* next = g->next;
+        if (g->kind == LGC_LVAL) {
+            lval_free((lval*)g);
+        } else {
+            lenv_free((lenv*)g);
+        }
+        g = next;
+    }
+
+    lgc_live -= freed;
+    return freed;
+}
+
+/* Moves every young object into the old generation. */
+static void lgc_promote(void) {
+    if (lgc_young.next == &lgc_young) { return; }
+
+    for (lgc* g = lgc_young.next; g != &lgc_young; g = g->next) {
+        g->gen = 1;
+    }
+    lgc_young.prev->next = lgc_old.next;
+    lgc_old.next->prev = lgc_young.prev;
+    lgc_old.next = lgc_young.next;
+    lgc_young.next->prev = &lgc_old;
+    lgc_young.next = lgc_young.prev = &lgc_young;
+}
+
+int lgc_collect(void) {
+    lgc_promote();
+    int freed = lgc_collect_gen(&lgc_old, 1);
+
+    lgc_allocs = 0;
+    lgc_minors = 0;
+    if (lgc_mode != LGC_GENERATIONAL) {
+        lgc_threshold = lgc_live > LGC_THRESHOLD ? lgc_live : LGC_THRESHOLD;
+    }
+
+    return freed;
+}
+
+int lgc_collect_young(void) {
+    int freed = lgc_collect_gen(&lgc_young, 0);
+    lgc_promote();
+
+    lgc_allocs = 0;
+    lgc_minors++;
+
+    return freed;
+}
+
+void lgc_maybe_collect(void) {
+    if (lgc_allocs < lgc_threshold) { return; }
+
+    if (lgc_mode == LGC_GENERATIONAL && lgc_minors < LGC_MINORS) {
+        lgc_collect_young();
+    } else {
+        lgc_collect();
+    }
+}
+
+/*
+ * A form that keeps a lot alive would otherwise take a new arena block
+ * every time one fills, so after LARENA_BLOCKS of them the rest of the
+ * form allocates from the slabs.
+ */
+void lgc_form_begin(void) {
+    if (lgc_forms++ == 0) { lgc_form_blocks = 0; }
+}
+
+/*
+ * Once the outermost form is done every temporary it allocated should be
+ * dead, so the nursery block is simply rewound. Anything that is still
+ * alive keeps its block, which is then retired instead.
+ */
+void lgc_form_end(void) {
+    if (--lgc_forms > 0 || lgc_mode != LGC_ARENA) { return; }
+
+    lblock* b = lgc_nursery;
+    if (!b) { return; }
+    if (b->live) {
+        lblock_retire(b);
+        lgc_nursery = NULL;
+    } else {
+        lblock_reset(b);
+    }
+}
+
+/* A value being evacuated, with its copy once one of its children moved. */
+typedef struct {
+    lval* v;
+    lval* x;
+    int i;
+} levac;
+
+static levac* levac_stack = NULL;
+static int levac_count = 0;
+static int levac_cap = 0;
+
+static void levac_push(lval* v) {
+    if (levac_count == levac_cap) {
+        levac_cap = levac_cap ? levac_cap * 2 : 256;
+        levac_stack = realloc(levac_stack, sizeof(levac) * levac_cap);
+    }
+    levac_stack[levac_count++] = (levac){ v, NULL, 0 };
+}
+
+/* Whether v, or the array a slice v shares, was allocated in the arena. */
+static int lval_arena(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return 0; }
+    if (v->gc.block) { return 1; }
+    return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+        && v->base && v->base->gc.block;
+}
+
+static int lval_evac_count(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return 0; }
+    switch (v->type) {
+        case LVAL_FUN:   return v->buildtin ? 0 : 2 + v->env->count;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: return v->count;
+    }
+    return 0;
+}
+
+static lval** lval_evac_slot(lval* v, int i) {
+    if (v->type == LVAL_FUN) {
+        return i == 0 ? &v->formals : i == 1 ? &v->body : &v->env->vals[i-2];
+    }
+    return &v->cell[i];
+}
+
+/*
+ * Vectors and maps keep their elements in their own nodes rather than a
+ * cell array, so each element that has to move is put back with assoc,
+ * which copies only the path down to it.
+ */
+static lval* lgc_evacuate_items(lval* v) {
+    lval* r = lval_ref(v);
+    if (v->type == LVAL_VEC) {
+        for (int i = 0; i < v->vcount; i++) {
+            lval* x = lvec_nth(v, i);
+            lval* y = lgc_evacuate(x);
+            if (y == x) {
+                lval_del(y);
+            } else {
+                r = lvec_assoc(r, i, y);
+            }
+        }
+    } else {
+        lval* items = lmap_items(v, 0);
+        for (int i = 0; i < items->count; i += 2) {
+            lval* k = lgc_evacuate(items->cell[i]);
+            lval* x = lgc_evacuate(items->cell[i+1]);
+            if (k == items->cell[i] && x == items->cell[i+1]) {
+                lval_del(k);
+                lval_del(x);
+                continue;
+            }
+            if (k != items->cell[i]) { r = lmap_dissoc(r, items->cell[i]); }
+            r = lmap_assoc(r, k, x);
+        }
+        lval_del(items);
+    }
+
+    if (lval_arena(r)) {
+        lval* x = lval_copy(r);
+        lval_del(r);
+        r = x;
+    }
+    return r;
+}
+
+/*
+ * Returns a reference to v that lives entirely outside the arena, copying
+ * whatever part of it was allocated while evaluating the current form.
+ * Used for values escaping into the global environment, so they do not
+ * pin nursery blocks once the form is done.
+ *
+ * Children are evacuated before their parent, from a stack on the heap,
+ * and a parent is copied only if it is in the arena or a child moved.
+ */
+lval* lgc_evacuate(lval* v) {
+    if (lgc_mode != LGC_ARENA) { return lval_ref(v); }
+
+    int forms = lgc_forms;
+    lgc_forms = 0;
+
+    int base = levac_count;
+    levac_push(v);
+    lval* r = NULL;
+
+    for (;;) {
+        levac* f = &levac_stack[levac_count-1];
+        if (r) {
+            lval** slot = lval_evac_slot(f->x ? f->x : f->v, f->i-1);
+            if (r == *slot) {
+                lval_del(r);
+            } else {
+                if (!f->x) {
+                    f->x = lval_copy(f->v);
+                    slot = lval_evac_slot(f->x, f->i-1);
+                }
+                lval_del(*slot);
+                *slot = r;
+            }
+            r = NULL;
+        }
+
+        if (f->i < lval_evac_count(f->v)) {
+            levac_push(*lval_evac_slot(f->v, f->i++));
+            continue;
+        }
+
+        if (f->x) {
+            r = f->x;
+        } else if (lval_type(f->v) == LVAL_VEC || lval_type(f->v) == LVAL_MAP) {
+            r = lgc_evacuate_items(f->v);
+        } else if (lval_arena(f->v)) {
+            r = lval_copy(f->v);
+        } else {
+            r = lval_ref(f->v);
+        }
+        if (--levac_count == base) { break; }
+    }
+
+    lgc_forms = forms;
+    return r;
+}
@@ -0,0 +1,436 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "lval.h"
+
+#define LJIT_REGION (4 << 20)
+#define LJIT_STACK (1 << 20)
+#define LJIT_ARGS 6
+#define LJIT_BAILS 16
+
+/*
+ * A global binding the native code of a lambda assumed when it was
+ * compiled: an operator bound to its builtin, or a called lambda bound to
+ * the same formals and body.
+ */
+typedef struct {
+    char* sym;
+    int slot;
+    lbuildtin fn;
+    lval* formals;
+    lval* body;
+    int held;
+} lguard;
+
+struct ljit {
+    unsigned char* code;
+    int bails;
+    int count;
+    lguard* guards;
+};
+
+enum { LJIT_OK, LJIT_NEVER, LJIT_LATER };
+
+int ljit_enabled = 1;
+
+#if defined(__x86_64__)
+
+static struct {
+    char* name;
+    lbuildtin fn;
+} ljit_ops[] = {
+    { "+",  builtin_add },
+    { "-",  builtin_sub },
+    { "*",  builtin_mul },
+    { "/",  builtin_div },
+    { ">",  buildtin_gt },
+    { "<",  buildtin_lt },
+    { ">=", buildtin_ge },
+    { "<=", buildtin_le },
+    { "==", buildtin_eq },
+    { "!=", buildtin_ne },
+    { "if", buildtin_if },
+};
+
+enum { LJIT_ADD, LJIT_SUB, LJIT_MUL, LJIT_DIV, LJIT_GT, LJIT_LT,
+       LJIT_GE, LJIT_LE, LJIT_EQ, LJIT_NE, LJIT_IF, LJIT_NOPS };
+
+/* setcc opcodes for the comparisons, from LJIT_GT on */
+static unsigned char ljit_setcc[] = { 0x9F, 0x9C, 0x9D, 0x9E, 0x94, 0x95 };
+
+/* argument registers in the order of the System V calling convention */
+static unsigned char ljit_regs[] = { 7, 6, 2, 1, 8, 9 };
+
+static unsigned char* ljit_region = NULL;
+static unsigned char* ljit_top = NULL;
+static unsigned char* ljit_bail = NULL;
+static unsigned char* ljit_enter = NULL;
+
+/* read by the native code: where to unwind to, and how deep it may go */
+static uintptr_t ljit_sp = 0;
+static uintptr_t ljit_limit = 0;
+static int ljit_bailed = 0;
+
+/* The lambda being compiled, and where its code goes. */
+typedef struct {
+    lenv* top;
+    lval* f;
+    ljit* jit;
+    unsigned char* p;
+    unsigned char* end;
+    unsigned char* body;
+    int status;
+} lemit;
+
+static void ljit_byte(lemit* m, int b) {
+    if (m->p == m->end) { m->status = LJIT_NEVER; return; }
+    *m->p++ = b;
+}
+
+static void ljit_bytes(lemit* m, const char* s, int n) {
+    for (int i = 0; i < n; i++) { ljit_byte(m, (unsigned char)s[i]); }
+}
+
+static void ljit_int(lemit* m, int32_t x) {
+    for (int i = 0; i < 4; i++) { ljit_byte(m, (x >> (8 * i)) & 0xFF); }
+}
+
+static void ljit_long(lemit* m, uint64_t x) {
+    for (int i = 0; i < 8; i++) { ljit_byte(m, (x >> (8 * i)) & 0xFF); }
+}
+
+/* Emits a jump or call with a 32 bit displacement to target. */
+static void ljit_rel(lemit* m, const char* op, int n, unsigned char* target) {
+    ljit_bytes(m, op, n);
+    ljit_int(m, (int32_t)(target - (m->p + 4)));
+}
+
+/* Emits a jump to be pointed somewhere later with ljit_patch. */
+static unsigned char* ljit_jump(lemit* m, const char* op, int n) {
+    ljit_bytes(m, op, n);
+    unsigned char* at = m->p;
+    ljit_int(m, 0);
+    return at;
+}
+
+static void ljit_patch(lemit* m, unsigned char* at) {
+    if (m->status != LJIT_OK) { return; }
+    int32_t d = (int32_t)(m->p - (at + 4));
+    memcpy(at, &d, 4);
+}
+
+/* mov r10, imm64 */
+static void ljit_addr(lemit* m, void* p) {
+    ljit_bytes(m, "\x49\xBA", 2);
+    ljit_long(m, (uintptr_t)p);
+}
+
+/*
+ * Adds a guard unless sym already has one; code assuming two different
+ * bindings for the same symbol can never run. Guards on other lambdas hold
+ * their formals and body, so neither can be freed and its address reused
+ * while this code may still run.
+ */
+static void ljit_guard(lemit* m, char* sym, lbuildtin fn, lval* formals, lval* body) {
+    for (int i = 0; i < m->jit->count; i++) {
+        lguard* g = &m->jit->guards[i];
+        if (g->sym != sym) { continue; }
+        if (g->fn != fn || g->formals != formals || g->body != body) {
+            m->status = LJIT_NEVER;
+        }
+        return;
+    }
+    int held = body && body != m->f->body;
+    m->jit->count++;
+    m->jit->guards = realloc(m->jit->guards, sizeof(lguard) * m->jit->count);
+    m->jit->guards[m->jit->count-1] = (lguard){
+        sym, lenv_find(m->top, sym), fn,
+        held ? lval_ref(formals) : formals, held ? lval_ref(body) : body, held,
+    };
+}
+
+static void ljit_expr(lemit* m, lval* x);
+
+/*
+ * Emits code leaving the value of the S-Expression with cells x in rax.
+ * A call to this same lambda in tail position reuses the native frame.
+ */
+static void ljit_sexpr(lemit* m, lval** x, int n, int tail) {
+    if (n == 0) { m->status = LJIT_NEVER; return; }
+    if (n == 1) { ljit_expr(m, x[0]); return; }
+
+    lval* f = m->f;
+    if (lval_type(x[0]) != LVAL_SYM) { m->status = LJIT_NEVER; return; }
+    for (int i = 0; i < f->formals->count; i++) {
+        if (f->formals->cell[i]->sym == x[0]->sym) { m->status = LJIT_NEVER; return; }
+    }
+
+    int slot = lenv_find(m->top, x[0]->sym);
+    lval* g = slot < 0 ? NULL : m->top->vals[slot];
+    if (!g || lval_type(g) != LVAL_FUN) { m->status = LJIT_NEVER; return; }
+
+    int op = LJIT_NOPS;
+    for (int i = 0; g->buildtin && i < LJIT_NOPS; i++) {
+        if (ljit_ops[i].fn == g->buildtin) { op = i; }
+    }
+
+    if (op == LJIT_IF) {
+        if (n != 4 || lval_type(x[2]) != LVAL_QEXPR || lval_type(x[3]) != LVAL_QEXPR) {
+            m->status = LJIT_NEVER;
+            return;
+        }
+        ljit_guard(m, x[0]->sym, g->buildtin, NULL, NULL);
+        ljit_expr(m, x[1]);
+        ljit_bytes(m, "\x48\x85\xC0", 3);
+        unsigned char* alt = ljit_jump(m, "\x0F\x84", 2);
+        ljit_sexpr(m, x[2]->cell, x[2]->count, tail);
+        unsigned char* end = ljit_jump(m, "\xE9", 1);
+        ljit_patch(m, alt);
+        ljit_sexpr(m, x[3]->cell, x[3]->count, tail);
+        ljit_patch(m, end);
+        return;
+    }
+
+    if (op < LJIT_NOPS) {
+        if (n < 2 || (op >= LJIT_GT && n != 3)) { m->status = LJIT_NEVER; return; }
+        ljit_guard(m, x[0]->sym, g->buildtin, NULL, NULL);
+
+        ljit_expr(m, x[1]);
+        if (op == LJIT_SUB && n == 2) {
+            ljit_bytes(m, "\x48\xF7\xD8", 3);
+            ljit_rel(m, "\x0F\x80", 2, ljit_bail);
+        }
+        for (int i = 2; i < n; i++) {
+            ljit_byte(m, 0x50);
+            ljit_expr(m, x[i]);
+            ljit_bytes(m, "\x48\x89\xC1\x58", 4);
+            switch (op) {
+                case LJIT_ADD: ljit_bytes(m, "\x48\x01\xC8", 3); break;
+                case LJIT_SUB: ljit_bytes(m, "\x48\x29\xC8", 3); break;
+                case LJIT_MUL: ljit_bytes(m, "\x48\x0F\xAF\xC1", 4); break;
+                case LJIT_DIV:
+                    ljit_bytes(m, "\x48\x85\xC9", 3);
+                    ljit_rel(m, "\x0F\x84", 2, ljit_bail);
+                    ljit_bytes(m, "\x48\x83\xF9\xFF", 4);
+                    ljit_rel(m, "\x0F\x84", 2, ljit_bail);
+                    ljit_bytes(m, "\x48\x99\x48\xF7\xF9", 5);
+                    break;
+                default:
+                    ljit_bytes(m, "\x48\x39\xC8\x0F", 4);
+                    ljit_byte(m, ljit_setcc[op - LJIT_GT]);
+                    ljit_bytes(m, "\xC0\x0F\xB6\xC0", 4);
+                    break;
+            }
+            if (op <= LJIT_MUL) { ljit_rel(m, "\x0F\x80", 2, ljit_bail); }
+        }
+        return;
+    }
+
+    /* a call to this lambda or to one already compiled */
+    if (g->buildtin || g->env->count || n - 1 != g->formals->count) {
+        m->status = LJIT_NEVER;
+        return;
+    }
+    unsigned char* target;
+    if (g->body == f->body && g->formals == f->formals) {
+        target = m->jit->code;
+    } else {
+        ljit* j = lvm_jit(g->body);
+        if (!j) { m->status = LJIT_LATER; return; }
+        target = j->code;
+        for (int i = 0; i < j->count; i++) {
+            lguard* d = &j->guards[i];
+            ljit_guard(m, d->sym, d->fn, d->formals, d->body);
+        }
+    }
+    ljit_guard(m, x[0]->sym, NULL, g->formals, g->body);
+
+    for (int i = 1; i < n; i++) {
+        ljit_expr(m, x[i]);
+        ljit_byte(m, 0x50);
+    }
+    if (tail && target == m->jit->code) {
+        for (int i = n - 2; i >= 0; i--) {
+            ljit_bytes(m, "\x8F\x45", 2);
+            ljit_byte(m, -8 * (i + 1));
+        }
+        ljit_rel(m, "\xE9", 1, m->body);
+        return;
+    }
+    for (int i = n - 2; i >= 0; i--) {
+        if (ljit_regs[i] >= 8) { ljit_byte(m, 0x41); }
+        ljit_byte(m, 0x58 + (ljit_regs[i] & 7));
+    }
+    ljit_rel(m, "\xE8", 1, target);
+}
+
+static void ljit_expr(lemit* m, lval* x) {
+    if (m->status != LJIT_OK) { return; }
+
+    switch (lval_type(x)) {
+        case LVAL_NUM:
+            ljit_bytes(m, "\x48\xB8", 2);
+            ljit_long(m, (uint64_t)lval_long(x));
+            return;
+        case LVAL_SYM:
+            for (int i = 0; i < m->f->formals->count; i++) {
+                if (m->f->formals->cell[i]->sym == x->sym) {
+                    ljit_bytes(m, "\x48\x8B\x45", 3);
+                    ljit_byte(m, -8 * (i + 1));
+                    return;
+                }
+            }
+            break;
+        case LVAL_SEXPR:
+            ljit_sexpr(m, x->cell, x->count, 0);
+            return;
+    }
+    m->status = LJIT_NEVER;
+}
+
+/*
+ * Emits the stubs every native call goes through: ljit_enter loads the
+ * arguments and remembers the stack, and ljit_bail unwinds to it when a
+ * guard inside the code fails.
+ */
+static int ljit_init(void) {
+    ljit_region = mmap(NULL, LJIT_REGION, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ljit_region == MAP_FAILED) { ljit_region = NULL; return 0; }
+
+    lemit m = { NULL, NULL, NULL, ljit_region, ljit_region + LJIT_REGION, NULL, LJIT_OK };
+
+    ljit_bail = m.p;
+    ljit_addr(&m, &ljit_sp);
+    ljit_bytes(&m, "\x49\x8B\x22", 3);
+    ljit_addr(&m, &ljit_bailed);
+    ljit_bytes(&m, "\x41\xC7\x02\x01\x00\x00\x00\x5D\xC3", 9);
+
+    ljit_enter = m.p;
+    ljit_byte(&m, 0x55);
+    ljit_addr(&m, &ljit_sp);
+    ljit_bytes(&m, "\x49\x89\x22\x49\x89\xFB\x48\x89\xF0", 9);
+    ljit_bytes(&m, "\x48\x8B\x38\x48\x8B\x70\x08\x48\x8B\x50\x10", 11);
+    ljit_bytes(&m, "\x48\x8B\x48\x18\x4C\x8B\x40\x20\x4C\x8B\x48\x28", 12);
+    ljit_bytes(&m, "\x41\xFF\xD3\x5D\xC3", 5);
+
+    ljit_top = m.p;
+    return mprotect(ljit_region, LJIT_REGION, PROT_READ | PROT_EXEC) == 0;
+}
+
+/*
+ * Compiles f to native code if its body only does fixnum arithmetic,
+ * comparisons and 'if' on its formals, and calls itself or lambdas
+ * already compiled. Returns NULL if it never can be, setting *later if
+ * it might once its callees are compiled.
+ */
+ljit* ljit_compile(lenv* top, lval* f, int* later) {
+    *later = 0;
+    if (!ljit_region && !ljit_init()) { return NULL; }
+
+    int n = f->formals->count;
+    if (!ljit_enter || f->env->count || n == 0 || n > LJIT_ARGS) { return NULL; }
+    for (int i = 0; i < n; i++) {
+        if (strcmp(f->formals->cell[i]->sym, "&") == 0) { return NULL; }
+    }
+
+    ljit* jit = calloc(1, sizeof(ljit));
+    jit->code = ljit_top;
+    lemit m = { top, f, jit, ljit_top, ljit_region + LJIT_REGION, NULL, LJIT_OK };
+
+    mprotect(ljit_region, LJIT_REGION, PROT_READ | PROT_WRITE);
+
+    ljit_bytes(&m, "\x55\x48\x89\xE5", 4);
+    ljit_addr(&m, &ljit_limit);
+    ljit_bytes(&m, "\x49\x3B\x22", 3);
+    ljit_rel(&m, "\x0F\x82", 2, ljit_bail);
+    ljit_bytes(&m, "\x48\x83\xEC", 3);
+    ljit_byte(&m, 8 * n);
+    for (int i = 0; i < n; i++) {
+        ljit_byte(&m, ljit_regs[i] >= 8 ? 0x4C : 0x48);
+        ljit_byte(&m, 0x89);
+        ljit_byte(&m, 0x45 | (ljit_regs[i] & 7) << 3);
+        ljit_byte(&m, -8 * (i + 1));
+    }
+    m.body = m.p;
+    ljit_sexpr(&m, f->body->cell, f->body->count, 1);
+    ljit_bytes(&m, "\xC9\xC3", 2);
+
+    mprotect(ljit_region, LJIT_REGION, PROT_READ | PROT_EXEC);
+
+    if (m.status != LJIT_OK) {
+        *later = m.status == LJIT_LATER;
+        ljit_free(jit);
+        return NULL;
+    }
+    ljit_top = m.p;
+    return jit;
+}
+
+/*
+ * Runs the native code of f on n fixnum arguments. Returns NULL, for the
+ * VM to evaluate the call instead, if an argument is not a number, a
+ * binding the code assumed has changed, or the code bailed out on an
+ * overflow, a division it leaves to the builtin, or deep recursion.
+ * The code has no side effects, so bailing part way is safe.
+ */
+lval* ljit_run(ljit* jit, lenv* e, lval** a, int n) {
+    if (jit->bails >= LJIT_BAILS) { return NULL; }
+
+    long args[LJIT_ARGS] = { 0 };
+    for (int i = 0; i < n; i++) {
+        if (lval_type(a[i]) != LVAL_NUM) { return NULL; }
+        args[i] = lval_long(a[i]);
+    }
+
+    lenv* top = e->top;
+    if (!top) { return NULL; }
+    for (int i = 0; i < jit->count; i++) {
+        lguard* g = &jit->guards[i];
+        if (LSYM(g->sym)->frames || g->slot < 0 || g->slot >= top->count
+            || top->syms[g->slot] != g->sym) { return NULL; }
+        lval* v = top->vals[g->slot];
+        if (lval_type(v) != LVAL_FUN) { return NULL; }
+        if (g->fn ? v->buildtin != g->fn
+                  : v->buildtin || v->env->count
+                    || v->body != g->body || v->formals != g->formals) {
+            return NULL;
+        }
+    }
+
+    char here;
+    ljit_limit = (uintptr_t)&here - LJIT_STACK;
+    ljit_bailed = 0;
+    long r = ((long (*)(void*, long*))(void*)ljit_enter)(jit->code, args);
+    if (ljit_bailed) {
+        jit->bails++;
+        return NULL;
+    }
+    return lval_num(r);
+}
+
+#else
+
+ljit* ljit_compile(lenv* top, lval* f, int* later) {
+    *later = 0;
+    return NULL;
+}
+
+lval* ljit_run(ljit* jit, lenv* e, lval** a, int n) {
+    return NULL;
+}
+
+#endif
+
+void ljit_free(ljit* jit) {
+    for (int i = 0; i < jit->count; i++) {
+        if (jit->guards[i].held) {
+            lval_del(jit->guards[i].formals);
+            lval_del(jit->guards[i].body);
+        }
+    }
+    free(jit->guards);
+    free(jit);
+}
@@ -0,0 +1,316 @@
+#include "lval.h"
+
+/*
+ * A node of a persistent hash map: a hash array mapped trie. Each level
+ * takes the next five bits of a key's hash, and the bitmap says which of
+ * the 32 slots are in use, so only those are stored. A slot holds either
+ * one key and its value or the node below. Keys whose hashes agree in
+ * all 32 bits end up together in a node past the last level, searched in
+ * order.
+ */
+typedef struct {
+    unsigned hash;
+    lval* key;
+    lval* val;
+    lmap* node;
+} lentry;
+
+struct lmap {
+    int ref;
+    int count;
+    unsigned bitmap;
+    lentry* entries;
+};
+
+#define LMAP_LEAF(shift) ((shift) >= 32)
+
+static lmap* lmap_node(int count) {
+    lmap* n = malloc(sizeof(lmap));
+    n->ref = 1;
+    n->count = count;
+    n->bitmap = 0;
+    n->entries = malloc(sizeof(lentry) * (count ? count : 1));
+    return n;
+}
+
+lmap* lmap_ref(lmap* n) {
+    n->ref++;
+    return n;
+}
+
+void lmap_del(lmap* n) {
+    if (--n->ref > 0) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (n->entries[i].key) {
+            lval_del(n->entries[i].key);
+            lval_del(n->entries[i].val);
+        } else {
+            lmap_del(n->entries[i].node);
+        }
+    }
+    free(n->entries);
+    free(n);
+}
+
+/* Returns n ready to be changed, copying it unless mine and nothing else holds it. */
+static lmap* lmap_edit(lmap* n, int mine) {
+    if (mine && n->ref == 1) { return n; }
+    lmap* c = lmap_node(n->count);
+    c->bitmap = n->bitmap;
+    for (int i = 0; i < n->count; i++) {
+        lentry e = n->entries[i];
+        if (e.key) {
+            lval_ref(e.key);
+            lval_ref(e.val);
+        } else {
+            lmap_ref(e.node);
+        }
+        c->entries[i] = e;
+    }
+    return c;
+}
+
+static void lmap_insert(lmap* n, int i, lentry e) {
+    n->entries = realloc(n->entries, sizeof(lentry) * (n->count + 1));
+    memmove(&n->entries[i+1], &n->entries[i], sizeof(lentry) * (n->count - i));
+    n->entries[i] = e;
+    n->count++;
+}
+
+static void lmap_remove(lmap* n, int i) {
+    memmove(&n->entries[i], &n->entries[i+1], sizeof(lentry) * (n->count - i - 1));
+    n->count--;
+}
+
+static int lmap_index(lmap* n, unsigned bit) {
+    return __builtin_popcount(n->bitmap & (bit - 1));
+}
+
+static unsigned lmap_bit(unsigned hash, int shift) {
+    return 1u << ((hash >> shift) & 31);
+}
+
+lval* lmap_get(lval* m, lval* k) {
+    unsigned h = lval_hash(k);
+    lmap* n = m->map;
+    for (int shift = 0; n; shift += 5) {
+        if (LMAP_LEAF(shift)) {
+            for (int i = 0; i < n->count; i++) {
+                if (lval_eq(n->entries[i].key, k)) { return n->entries[i].val; }
+            }
+            return NULL;
+        }
+
+        unsigned bit = lmap_bit(h, shift);
+        if (!(n->bitmap & bit)) { return NULL; }
+        lentry* e = &n->entries[lmap_index(n, bit)];
+        if (!e->key) { n = e->node; continue; }
+        return e->hash == h && lval_eq(e->key, k) ? e->val : NULL;
+    }
+    return NULL;
+}
+
+/* A node at shift holding the two entries a and b, whose keys differ. */
+static lmap* lmap_pair(int shift, lentry a, lentry b) {
+    if (LMAP_LEAF(shift)) {
+        lmap* n = lmap_node(2);
+        n->entries[0] = a;
+        n->entries[1] = b;
+        return n;
+    }
+
+    unsigned ba = lmap_bit(a.hash, shift);
+    unsigned bb = lmap_bit(b.hash, shift);
+    if (ba == bb) {
+        lmap* n = lmap_node(1);
+        n->bitmap = ba;
+        n->entries[0] = (lentry){ 0, NULL, NULL, lmap_pair(shift + 5, a, b) };
+        return n;
+    }
+
+    lmap* n = lmap_node(2);
+    n->bitmap = ba | bb;
+    n->entries[ba < bb ? 0 : 1] = a;
+    n->entries[ba < bb ? 1 : 0] = b;
+    return n;
+}
+
+static lmap* lmap_put(lmap* n, int shift, lentry x, int mine, int* added) {
+    if (LMAP_LEAF(shift)) {
+        lmap* c = lmap_edit(n, mine);
+        for (int i = 0; i < c->count; i++) {
+            if (lval_eq(c->entries[i].key, x.key)) {
+                lval_del(x.key);
+                lval_del(c->entries[i].val);
+                c->entries[i].val = x.val;
+                return c;
+            }
+        }
+        lmap_insert(c, c->count, x);
+        *added = 1;
+        return c;
+    }
+
+    unsigned bit = lmap_bit(x.hash, shift);
+    int i = lmap_index(n, bit);
+
+    if (!(n->bitmap & bit)) {
+        lmap* c = lmap_edit(n, mine);
+        c->bitmap |= bit;
+        lmap_insert(c, i, x);
+        *added = 1;
+        return c;
+    }
+
+    lentry e = n->entries[i];
+    if (!e.key) {
+        lmap* kid = lmap_put(e.node, shift + 5, x, mine && n->ref == 1, added);
+        lmap* c = lmap_edit(n, mine);
+        if (kid != c->entries[i].node) {
+            lmap_del(c->entries[i].node);
+            c->entries[i].node = kid;
+        }
+        return c;
+    }
+
+    lmap* c = lmap_edit(n, mine);
+    if (e.hash == x.hash && lval_eq(e.key, x.key)) {
+        lval_del(x.key);
+        lval_del(c->entries[i].val);
+        c->entries[i].val = x.val;
+        return c;
+    }
+
+    /* the entry already there keeps the references c holds to it */
+    e = c->entries[i];
+    c->entries[i] = (lentry){ 0, NULL, NULL, lmap_pair(shift + 5, e, x) };
+    *added = 1;
+    return c;
+}
+
+/* Returns n without k, or n itself, untouched, if k is not in it. */
+static lmap* lmap_take(lmap* n, int shift, unsigned h, lval* k, int mine, int* removed) {
+    if (LMAP_LEAF(shift)) {
+        for (int i = 0; i < n->count; i++) {
+            if (!lval_eq(n->entries[i].key, k)) { continue; }
+            lmap* c = lmap_edit(n, mine);
+            lval_del(c->entries[i].key);
+            lval_del(c->entries[i].val);
+            lmap_remove(c, i);
+            *removed = 1;
+            return c;
+        }
+        return n;
+    }
+
+    unsigned bit = lmap_bit(h, shift);
+    if (!(n->bitmap & bit)) { return n; }
+    int i = lmap_index(n, bit);
+    lentry e = n->entries[i];
+
+    if (e.key) {
+        if (e.hash != h || !lval_eq(e.key, k)) { return n; }
+        lmap* c = lmap_edit(n, mine);
+        lval_del(c->entries[i].key);
+        lval_del(c->entries[i].val);
+        lmap_remove(c, i);
+        c->bitmap &= ~bit;
+        *removed = 1;
+        return c;
+    }
+
+    lmap* kid = lmap_take(e.node, shift + 5, h, k, mine && n->ref == 1, removed);
+    if (!*removed) { return n; }
+
+    lmap* c = lmap_edit(n, mine);
+    if (kid != c->entries[i].node) {
+        lmap_del(c->entries[i].node);
+        c->entries[i].node = kid;
+    }
+
+    /* a node left with a single key is folded back into its parent */
+    if (kid->count == 0) {
+        lmap_del(kid);
+        lmap_remove(c, i);
+        c->bitmap &= ~bit;
+    } else if (kid->count == 1 && kid->entries[0].key) {
+        lentry only = kid->entries[0];
+        c->entries[i] = (lentry){ only.hash, lval_ref(only.key), lval_ref(only.val), NULL };
+        lmap_del(kid);
+    }
+    return c;
+}
+
+/*
+ * Gives m the trie rooted at root in place of its own, or a new map when
+ * m is shared.
+ */
+static lval* lmap_result(lval* m, lmap* root, int count) {
+    if (m->ref == 1) {
+        if (m->map && m->map != root) { lmap_del(m->map); }
+    } else {
+        lval_del(m);
+        m = lval_map();
+    }
+    if (root && root->count == 0) {
+        lmap_del(root);
+        root = NULL;
+    }
+    m->map = root;
+    m->mcount = count;
+    return m;
+}
+
+lval* lmap_assoc(lval* m, lval* k, lval* v) {
+    lentry x = { lval_hash(k), k, v, NULL };
+    int added = 0;
+    lmap* root;
+    if (!m->map) {
+        root = lmap_node(1);
+        root->bitmap = lmap_bit(x.hash, 0);
+        root->entries[0] = x;
+        added = 1;
+    } else {
+        root = lmap_put(m->map, 0, x, m->ref == 1, &added);
+    }
+    return lmap_result(m, root, m->mcount + added);
+}
+
+lval* lmap_dissoc(lval* m, lval* k) {
+    int removed = 0;
+    lmap* root = m->map ? lmap_take(m->map, 0, lval_hash(k), k, m->ref == 1, &removed) : NULL;
+    if (!removed) { return m; }
+    return lmap_result(m, root, m->mcount - 1);
+}
+
+static void lmap_collect(lmap* n, lval* q, int keys) {
+    for (int i = 0; i < n->count; i++) {
+        lentry* e = &n->entries[i];
+        if (!e->key) {
+            lmap_collect(e->node, q, keys);
+            continue;
+        }
+        q->cell[q->count++] = lval_ref(e->key);
+        if (!keys) { q->cell[q->count++] = lval_ref(e->val); }
+    }
+}
+
+/* A Q-Expression of the keys of m, followed by each value if keys is 0. */
+lval* lmap_items(lval* m, int keys) {
+    lval* q = lval_qexpr();
+    if (!m->map) { return q; }
+    q->cell = lcell_alloc(keys ? m->mcount : 2 * m->mcount);
+    lmap_collect(m->map, q, keys);
+    return q;
+}
+
+/* Independent of the order entries were added in, as lval_eq is. */
+unsigned lmap_hash(lval* m) {
+    lval* q = lmap_items(m, 0);
+    unsigned h = m->mcount;
+    for (int i = 0; i < q->count; i += 2) {
+        h += lval_hash(q->cell[i]) * 31 + lval_hash(q->cell[i+1]);
+    }
+    lval_del(q);
+    return h;
+}
@@ -0,0 +1,172 @@
+#include "lval.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define LMAT_AVX2 1
+#endif
+
+/*
+ * Matrices hold doubles in one row-major block. Multiplication works on
+ * tiles of LMAT_KB rows of b by LMAT_JB columns, small enough to stay in
+ * cache while every row of a passes over them. Each element of the
+ * result is still summed in order of k, whether four rows by eight
+ * columns go through AVX2 registers at once or one goes through the
+ * scalar loop, so both give equal results.
+ */
+#define LMAT_KB 128
+#define LMAT_JB 128
+
+/*
+ * Whether a rows by cols matrix can be made. Every element has to be
+ * reachable with an int index, which also keeps the block well under
+ * SIZE_MAX bytes.
+ */
+int lmat_fits(long rows, long cols) {
+    long n;
+    return rows >= 0 && cols >= 0
+        && !__builtin_mul_overflow(rows, cols, &n) && n <= INT_MAX;
+}
+
+lval* lval_mat(int rows, int cols) {
+    lval* v = lval_alloc();
+    v->type = LVAL_MAT;
+    v->ref = 1;
+    v->rows = rows;
+    v->cols = cols;
+    size_t n = (size_t)rows * cols;
+    v->mat = calloc(n ? n : 1, sizeof(double));
+    return v;
+}
+
+lval* lmat_transpose(lval* m) {
+    lval* t = lval_mat(m->cols, m->rows);
+    for (int i = 0; i < m->rows; i += 32) {
+        for (int j = 0; j < m->cols; j += 32) {
+            for (int x = i; x < i + 32 && x < m->rows; x++) {
+                for (int y = j; y < j + 32 && y < m->cols; y++) {
+                    t->mat[y * t->cols + x] = m->mat[x * m->cols + y];
+                }
+            }
+        }
+    }
+    return t;
+}
+
+/* c[i][j..j+8] += a[i][k0..k1] * b[k0..k1][j..j+8], stopping at column end */
+static void lmat_tile(double* a, double* b, double* c, int p, int m,
+                      int i, int j, int end, int k0, int k1) {
+    for (int k = k0; k < k1; k++) {
+        double x = a[i * p + k];
+        for (int y = j; y < j + 8 && y < end; y++) {
+            c[i * m + y] += x * b[k * m + y];
+        }
+    }
+}
+
+#ifdef LMAT_AVX2
+/* c[i..i+4][j..j+8] += a[i..i+4][k0..k1] * b[k0..k1][j..j+8] */
+__attribute__((target("avx2")))
+static void lmat_tile_avx2(double* a, double* b, double* c, int p, int m,
+                           int i, int j, int k0, int k1) {
+    double* r0 = c + i * m + j;
+    __m256d c00 = _mm256_loadu_pd(r0),         c01 = _mm256_loadu_pd(r0 + 4);
+    __m256d c10 = _mm256_loadu_pd(r0 + m),     c11 = _mm256_loadu_pd(r0 + m + 4);
+    __m256d c20 = _mm256_loadu_pd(r0 + 2 * m), c21 = _mm256_loadu_pd(r0 + 2 * m + 4);
+    __m256d c30 = _mm256_loadu_pd(r0 + 3 * m), c31 = _mm256_loadu_pd(r0 + 3 * m + 4);
+
+    double* a0 = a + i * p;
+    for (int k = k0; k < k1; k++) {
+        __m256d b0 = _mm256_loadu_pd(b + k * m + j);
+        __m256d b1 = _mm256_loadu_pd(b + k * m + j + 4);
+        __m256d x;
+        x = _mm256_broadcast_sd(a0 + k);
+        c00 = _mm256_add_pd(c00, _mm256_mul_pd(x, b0));
+        c01 = _mm256_add_pd(c01, _mm256_mul_pd(x, b1));
+        x = _mm256_broadcast_sd(a0 + p + k);
+        c10 = _mm256_add_pd(c10, _mm256_mul_pd(x, b0));
+        c11 = _mm256_add_pd(c11, _mm256_mul_pd(x, b1));
+        x = _mm256_broadcast_sd(a0 + 2 * p + k);
+        c20 = _mm256_add_pd(c20, _mm256_mul_pd(x, b0));
+        c21 = _mm256_add_pd(c21, _mm256_mul_pd(x, b1));
+        x = _mm256_broadcast_sd(a0 + 3 * p + k);
+        c30 = _mm256_add_pd(c30, _mm256_mul_pd(x, b0));
+        c31 = _mm256_add_pd(c31, _mm256_mul_pd(x, b1));
+    }
+
+    _mm256_storeu_pd(r0, c00);
+    _mm256_storeu_pd(r0 + 4, c01);
+    _mm256_storeu_pd(r0 + m, c10);
+    _mm256_storeu_pd(r0 + m + 4, c11);
+    _mm256_storeu_pd(r0 + 2 * m, c20);
+    _mm256_storeu_pd(r0 + 2 * m + 4, c21);
+    _mm256_storeu_pd(r0 + 3 * m, c30);
+    _mm256_storeu_pd(r0 + 3 * m + 4, c31);
+}
+#endif
+
+/* x times y; x has as many columns as y has rows. */
+lval* lmat_mul(lval* x, lval* y) {
+    int n = x->rows;
+    int p = x->cols;
+    int m = y->cols;
+    lval* r = lval_mat(n, m);
+    double* a = x->mat;
+    double* b = y->mat;
+    double* c = r->mat;
+    int simd = larr_avx2();
+
+    for (int k0 = 0; k0 < p; k0 += LMAT_KB) {
+        int k1 = k0 + LMAT_KB < p ? k0 + LMAT_KB : p;
+        for (int j0 = 0; j0 < m; j0 += LMAT_JB) {
+            int j1 = j0 + LMAT_JB < m ? j0 + LMAT_JB : m;
+            for (int i = 0; i < n; i += 4) {
+                for (int j = j0; j < j1; j += 8) {
+#ifdef LMAT_AVX2
+                    if (simd && i + 4 <= n && j + 8 <= j1) {
+                        lmat_tile_avx2(a, b, c, p, m, i, j, k0, k1);
+                        continue;
+                    }
+#endif
+                    for (int x = i; x < i + 4 && x < n; x++) {
+                        lmat_tile(a, b, c, p, m, x, j, j1, k0, k1);
+                    }
+                }
+            }
+        }
+    }
+    return r;
+}
+
+int lmat_eq(lval* x, lval* y) {
+    if (x->rows != y->rows || x->cols != y->cols) { return 0; }
+    size_t n = (size_t)x->rows * x->cols;
+    for (size_t i = 0; i < n; i++) {
+        if (x->mat[i] != y->mat[i]) { return 0; }
+    }
+    return 1;
+}
+
+unsigned lmat_hash(lval* v) {
+    unsigned h = (unsigned)v->rows * 31 + v->cols;
+    size_t n = (size_t)v->rows * v->cols;
+    for (size_t i = 0; i < n; i++) {
+        double d = v->mat[i] == 0 ? 0 : v->mat[i];
+        uint64_t b;
+        memcpy(&b, &d, sizeof(b));
+        h = (h ^ (unsigned)b ^ (unsigned)(b >> 32)) * 16777619u;
+    }
+    return h;
+}
+
+void lmat_print(lval* v) {
+    printf("#mat{");
+    for (int i = 0; i < v->rows; i++) {
+        printf(i ? " {" : "{");
+        for (int j = 0; j < v->cols; j++) {
+            if (j) { putchar(' '); }
+            lval_print_dbl(v->mat[i * v->cols + j]);
+        }
+        putchar('}');
+    }
+    putchar('}');
+}
@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <sys/resource.h>
+
 #include "lval.h"
 
 #define LASSERT(args, cond, fmt, ...)    \
@@ -5,11 +8,21 @@
         lval* err = lval_err(fmt, ##__VA_ARGS__);   \
         lval_del(args); return err; }
 
+#define LASSERT_NUMS(func, args) \
+    LASSERT(args, args->count > 0, "Function '%s' passed no arguments.", func); \
+    for (int i = 0; i < args->count; i++) {   \
+        LASSERT(args, lval_type(args->cell[i]) == LVAL_NUM  \
+            || lval_type(args->cell[i]) == LVAL_BIG   \
+            || lval_type(args->cell[i]) == LVAL_DBL,  \
+            "Cannot operate on non-number! Got %s, Expected %s.",   \
+            ltype_name(lval_type(args->cell[i])), ltype_name(LVAL_NUM)); \
+    }
+
 #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect,    \
+    LASSERT(args, lval_type(args->cell[index]) == expect,    \
         "Function '%s' passed incorrect type for argument %i. " \
         "Got %s, Expected %s.",     \
-        func, args->count, ltype_name(args->cell[index]->type), ltype_name(expect))
+        func, args->count, ltype_name(lval_type(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num)    \
     LASSERT(args, args->count == num,   \
@@ -21,6 +34,12 @@
     LASSERT(args, args->cell[index]->count != 0, \
         "Function '%s' passed {} for argument %i.", func, index)
 
+#define LASSERT_INDEX(func, args, index, count) \
+    LASSERT(args, lval_long(args->cell[index]) >= 0 \
+        && lval_long(args->cell[index]) < count,  \
+        "Function '%s' passed index %li out of range for %i elements.", \
+        func, lval_long(args->cell[index]), count)
+
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
@@ -30,20 +49,53 @@ char* ltype_name(int t) {
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_VEC: return "Vector";
+    case LVAL_MAP: return "Map";
+    case LVAL_BIG: return "Big Number";
+    case LVAL_DBL: return "Double";
+    case LVAL_ARR: return "Array";
+    case LVAL_MAT: return "Matrix";
     default: return "Unknown";
   }
 }
 
+/*
+ * Numbers that fit in 63 bits are stored directly in the pointer with the
+ * low bit set, so arithmetic never has to allocate. Only numbers outside
+ * that range get a heap node.
+ */
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
+    if (x >= LFIXNUM_MIN && x <= LFIXNUM_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
+    }
+
+    lval* v = lval_alloc();
     v->type = LVAL_NUM;
+    v->ref = 1;
     v->num = x;
     return v;
 }
 
+lval* lval_dbl(double x) {
+    uint64_t b;
+    memcpy(&b, &x, sizeof(b));
+    int top = (b >> 60) & 7;
+    if ((top == 3 || top == 4) && b != 0x3000000000000000u) {
+        return (lval*)((((b << 3) | (b >> 61)) & ~(uint64_t)1) | 2);
+    }
+    if (b == 0) { return (lval*)LFLONUM_ZERO; }
+
+    lval* v = lval_alloc();
+    v->type = LVAL_DBL;
+    v->ref = 1;
+    v->dbl = x;
+    return v;
+}
+
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_ERR;
+    v->ref = 1;
 
     va_list va;
 
@@ -60,38 +112,170 @@ lval* lval_err(char* fmt, ...) {
     return v;
 }
 
+static char** lsym_table = NULL;
+int lval_depth_max = 100000;
+
+/* S-Expressions being evaluated on the C stack by lval_eval */
+static int lval_depth = 0;
+
+static uintptr_t lval_stack_base = 0;
+static uintptr_t lval_stack_size = 0;
+
+/*
+ * Whether the C stack has grown within a quarter of its limit since the
+ * first evaluation, which the tree-walker and any builtin that evaluates
+ * recurse on however low lval_depth_max is set.
+ */
+static int lval_stack_full(void) {
+    char here;
+    uintptr_t p = (uintptr_t)&here;
+    if (!lval_stack_base) {
+        struct rlimit r;
+        lval_stack_base = p;
+        lval_stack_size = 8 << 20;
+        if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY) {
+            lval_stack_size = r.rlim_cur;
+        }
+        lval_stack_size = lval_stack_size / 4 * 3;
+    }
+    return (p < lval_stack_base ? lval_stack_base - p : p - lval_stack_base)
+        > lval_stack_size;
+}
+
+static int lsym_count = 0;
+static int lsym_cap = 0;
+
+static unsigned long lsym_hash(char* s) {
+    unsigned long h = 14695981039346656037UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*
+ * Returns the unique copy of the symbol name s. Symbols with the same
+ * name share the same pointer, so they can be compared with == and the
+ * string is never freed.
+ */
+char* lsym_intern(char* s) {
+    if (lsym_count * 2 >= lsym_cap) {
+        int cap = lsym_cap ? lsym_cap * 2 : 256;
+        char** table = calloc(cap, sizeof(char*));
+        for (int i = 0; i < lsym_cap; i++) {
+            if (!lsym_table[i]) { continue; }
+            unsigned long j = lsym_hash(lsym_table[i]) & (cap - 1);
+            while (table[j]) { j = (j + 1) & (cap - 1); }
+            table[j] = lsym_table[i];
+        }
+        free(lsym_table);
+        lsym_table = table;
+        lsym_cap = cap;
+    }
+
+    unsigned long i = lsym_hash(s) & (lsym_cap - 1);
+    while (lsym_table[i]) {
+        if (strcmp(lsym_table[i], s) == 0) { return lsym_table[i]; }
+        i = (i + 1) & (lsym_cap - 1);
+    }
+
+    lsym* x = malloc(sizeof(lsym) + strlen(s) + 1);
+    x->frames = 0;
+    strcpy(x->name, s);
+    lsym_table[i] = x->name;
+    lsym_count++;
+    return lsym_table[i];
+}
+
 lval* lval_sym(char* x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
-    v->sym = malloc(sizeof(x) + 1);
-    strcpy(v->sym, x);
+    v->ref = 1;
+    v->sym = lsym_intern(x);
+    v->slot = -1;
     return v;
 }
 
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPR;
+    v->ref = 1;
     v->count = 0;
+    v->hash = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->base = NULL;
+    lgc_track(&v->gc, LGC_LVAL);
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPR;
+    v->ref = 1;
     v->count = 0;
+    v->hash = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->base = NULL;
+    lgc_track(&v->gc, LGC_LVAL);
+    return v;
+}
+
+lval* lval_vec(void) {
+    lval* v = lval_alloc();
+    v->type = LVAL_VEC;
+    v->ref = 1;
+    v->vec = NULL;
+    v->vcount = 0;
+    return v;
+}
+
+lval* lval_map(void) {
+    lval* v = lval_alloc();
+    v->type = LVAL_MAP;
+    v->ref = 1;
+    v->map = NULL;
+    v->mcount = 0;
     return v;
 }
 
 lval* lval_fun(lbuildtin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
+    v->ref = 1;
     v->buildtin = func;
     return v;
 }
 
-void lval_del(lval* v) {
+/*
+ * Values reached by lval_del, lval_eq, lval_print and lval_resolve but
+ * not yet visited. Walking them from this stack on the heap rather than
+ * recursing lets lists nest as deep as memory allows.
+ */
+typedef struct {
+    lval* v;
+    lval* w;
+    int i;
+} lwalk;
+
+static lwalk* lwalk_stack = NULL;
+static int lwalk_count = 0;
+static int lwalk_cap = 0;
+static int lwalk_deleting = 0;
+
+static void lwalk_push(lval* v, lval* w, int i) {
+    if (lwalk_count == lwalk_cap) {
+        lwalk_cap = lwalk_cap ? lwalk_cap * 2 : 256;
+        lwalk_stack = realloc(lwalk_stack, sizeof(lwalk) * lwalk_cap);
+    }
+    lwalk_stack[lwalk_count++] = (lwalk){ v, w, i };
+}
+
+static void lval_destroy(lval* v) {
+    if (lval_traced(v)) { lgc_untrack(&v->gc); }
+
     switch (v->type) {
         case LVAL_FUN:
             if (!v->buildtin) {
@@ -106,31 +290,66 @@ void lval_del(lval* v) {
             free(v->err);
             break;
         case LVAL_STR:
+            if (v->strhash) { lcons_forget(v); }
             free(v->str);
             break;
         case LVAL_SYM:
-            free(v->sym);
             break;
         case LVAL_QEXPR:
         case LVAL_SEXPR:
+            if (v->hash) { lcons_forget(v); }
+            if (v->code) { lvm_free(v->code); }
+            if (v->base) { lval_del(v->base); break; }
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
-            free(v->cell);
+            lcell_free(v->cell, v->count);
+            break;
+        case LVAL_VEC:
+            if (v->vec) { lvec_del(v->vec); }
+            break;
+        case LVAL_MAP:
+            if (v->map) { lmap_del(v->map); }
+            break;
+        case LVAL_BIG:
+            free(v->limb);
+            break;
+        case LVAL_ARR:
+            free(v->ints);
+            break;
+        case LVAL_MAT:
+            free(v->mat);
             break;
     }
-    free(v);
+    lval_free(v);
+}
+
+/* Children released while a value is destroyed are queued, not recursed into. */
+void lval_del(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return; }
+    if (--v->ref > 0) { return; }
+
+    if (lwalk_deleting) { lwalk_push(v, NULL, 0); return; }
+
+    int base = lwalk_count;
+    lwalk_deleting = 1;
+    lval_destroy(v);
+    while (lwalk_count > base) {
+        lval_destroy(lwalk_stack[--lwalk_count].v);
+    }
+    lwalk_deleting = 0;
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
+    if (strpbrk(t->contents, ".eE")) { return lval_dbl(strtod(t->contents, NULL)); }
     errno = 0;
     long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("invalid number: %s", t->contents);
+    return errno != ERANGE ? lval_num(x) : lbig_read(t->contents);
 }
 
 lval* lval_add(lval* v, lval* x) {
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*)*v->count);
+    v->cell = lcell_realloc(v->cell, v->count-1, v->count);
     v->cell[v->count-1] = x;
     return v;
 }
@@ -156,41 +375,60 @@ lval* lval_read(mpc_ast_t* t) {
         x = lval_add(x, lval_read(t->children[i]));
     }
 
-    return x;
+    return x->type == LVAL_QEXPR ? lval_cons(x) : x;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
-        if (i != (v->count-1)) {
-            putchar(' ');
+/*
+ * Each S-Expression, Q-Expression or lambda being printed waits on the
+ * walk stack with the index of its next child.
+ */
+void lval_print(lval* v) {
+    int base = lwalk_count;
+
+    while (v) {
+        switch(lval_type(v)) {
+            case LVAL_NUM:      printf("%li", lval_long(v));     break;
+            case LVAL_BIG:      lbig_print(v);                   break;
+            case LVAL_ARR:      larr_print(v);                   break;
+            case LVAL_MAT:      lmat_print(v);                   break;
+            case LVAL_DBL:      lval_print_dbl(lval_double(v));  break;
+            case LVAL_ERR:      printf("Error: %s", v->err);     break;
+            case LVAL_SYM:      printf("%s", v->sym);            break;
+            case LVAL_STR:      lval_print_str(v);               break;
+            case LVAL_SEXPR:    putchar('('); lwalk_push(v, NULL, 0); break;
+            case LVAL_QEXPR:    putchar('{'); lwalk_push(v, NULL, 0); break;
+            case LVAL_VEC:      putchar('['); lwalk_push(v, NULL, 0); break;
+            case LVAL_MAP:      printf("#{"); lwalk_push(v, lmap_items(v, 0), 0); break;
+            case LVAL_FUN:
+                if (v->buildtin) {
+                    printf("<builtin>");
+                } else {
+                    printf("(\\");
+                    lwalk_push(v, NULL, 0);
+                }
+                break;
         }
-    }
-
-    putchar(close);
-}
 
-void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_NUM:      printf("%li", v->num);           break;
-        case LVAL_ERR:      printf("Error: %s", v->err);     break;
-        case LVAL_SYM:      printf("%s", v->sym);            break;
-        case LVAL_STR:      lval_print_str(v);               break;
-        case LVAL_SEXPR:    lval_expr_print(v, '(', ')');    break;
-        case LVAL_QEXPR:    lval_expr_print(v, '{', '}');    break;
-        case LVAL_FUN:      
-            if (v->buildtin) {
-                printf("<builtin>");
+        v = NULL;
+        while (!v && lwalk_count > base) {
+            lwalk* w = &lwalk_stack[lwalk_count-1];
+            int t = lval_type(w->v);
+            lval* items = w->w ? w->w : w->v;
+            int n = t == LVAL_FUN ? 2 : t == LVAL_VEC ? w->v->vcount : items->count;
+            if (w->i < n) {
+                if (w->i > 0) { putchar(' '); }
+                if (t == LVAL_FUN) {
+                    v = w->i ? w->v->body : w->v->formals;
+                } else {
+                    v = t == LVAL_VEC ? lvec_nth(w->v, w->i) : items->cell[w->i];
+                }
+                w->i++;
             } else {
-                printf("(\\");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                putchar(t == LVAL_QEXPR || t == LVAL_MAP ? '}' : t == LVAL_VEC ? ']' : ')');
+                if (w->w) { lval_del(w->w); }
+                lwalk_count--;
             }
-            break;
+        }
     }
 }
 
@@ -199,43 +437,86 @@ void lval_println(lval* v) {
     putchar('\n');
 }
 
+/*
+ * Calls in tail position, whether to a lambda, 'if' or 'eval', continue
+ * the loop with the expression they would evaluate instead of recursing,
+ * so loops run in constant C stack. frame holds the frame of a lambda
+ * entered that way.
+ */
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+    lenv* frame = NULL;
+    lval* x;
 
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
+    for (;;) {
+        for (int i = 0; i < v->count; i++) {
+            /* detached while evaluated so the collector never follows a consumed child */
+            lval* c = v->cell[i];
+            v->cell[i] = NULL;
+            v->cell[i] = lval_eval(e, c);
+            if (lval_type(v->cell[i]) == LVAL_ERR) {
+                x = lval_take(v, i);
+                goto done;
+            }
         }
-    }
 
-    if (v->count == 0) return v;
-    if (v->count == 1) return lval_take(v, 0);
+        if (v->count == 0) { x = v; goto done; }
+        if (v->count == 1) { x = lval_single(e, lval_take(v, 0)); goto done; }
+
+        lval* f = lval_pop(v, 0);
+        if (lval_type(f) != LVAL_FUN) {
+            x = lval_err(
+                "S-Expression starts with incorrect type. "
+                "Got %s, Expected %s.",
+                ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+            lval_del(f);
+            lval_del(v);
+            goto done;
+        }
 
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-            "S-Expression starts with incorrect type. "
-            "Got %s, Expected %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval* next;
+        if (f->buildtin) {
+            next = lval_tail_arg(f, v->cell, v->count);
+            if (!next) { x = lval_call(e, f, v); goto done; }
+            next = lval_ref(next);
+        } else if (!lvm_enabled && v->count == f->formals->count) {
+            lenv* n = lenv_frame(e, f, v->cell);
+            if (frame) { lenv_del(frame); }
+            e = frame = n;
+            next = lval_ref(f->body);
+        } else {
+            x = lval_call(e, f, v);
+            goto done;
+        }
         lval_del(f);
         lval_del(v);
-        return err;
-    }
 
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
+        lgc_maybe_collect();
+        v = lval_unshare(next);
+        v->type = LVAL_SEXPR;
+    }
 
-    return result;
+done:
+    if (frame) { lenv_del(frame); }
+    return x;
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
+    lgc_maybe_collect();
+
+    if (lval_type(v) == LVAL_SYM) {
         lval* x = lenv_get(e, v);
         lval_del(v);
         return x;
     }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    if (lval_type(v) == LVAL_SEXPR) {
+        if (lval_depth == lval_depth_max || lval_stack_full()) {
+            lval_del(v);
+            return lval_err("Maximum recursion depth exceeded.");
+        }
+        lval_depth++;
+        lval* x = lval_eval_sexpr(e, lval_unshare(v));
+        lval_depth--;
+        return x;
     }
     return v;
 }
@@ -244,7 +525,7 @@ lval* lval_pop(lval* v, int i) {
     lval* x = v->cell[i];
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*)*(v->count-i-1));
     v->count--;
-    v->cell = realloc(v->cell, sizeof(lval*)*v->count);
+    v->cell = lcell_realloc(v->cell, v->count+1, v->count);
     return x;
 }
 
@@ -254,9 +535,18 @@ lval* lval_take(lval* v, int i) {
     return x;
 }
 
+lval* lval_ref(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return v; }
+    v->ref++;
+    return v;
+}
+
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
+    if (LVAL_IMMEDIATE(v)) { return v; }
+
+    lval* x = lval_alloc();
     x->type = v->type;
+    x->ref = 1;
 
     switch (v->type) {
         case LVAL_FUN: 
@@ -265,70 +555,120 @@ lval* lval_copy(lval* v) {
             } else {
                 x->buildtin = NULL;
                 x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+                x->formals = lval_ref(v->formals);
+                x->body = lval_ref(v->body);
             }
             break;
         case LVAL_NUM: x->num = v->num;                 break;
+        case LVAL_DBL: x->dbl = v->dbl;                 break;
         case LVAL_ERR: 
-            x->err = malloc(sizeof(v->err) + 1);
+            x->err = malloc(strlen(v->err) + 1);
             strcpy(x->err, v->err);
             break;
         case LVAL_SYM:
-            x->sym = malloc(sizeof(v->sym) + 1);
-            strcpy(x->sym, v->sym);
+            x->sym = v->sym;
+            x->slot = v->slot;
             break;
         case LVAL_STR:
             x->str = malloc(strlen(v->str) + 1);
+            x->strhash = 0;
             strcpy(x->str, v->str);
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
+            x->hash = 0;
+            x->cell = lcell_alloc(x->count);
+            x->code = NULL;
+            x->base = NULL;
             for (int i = 0; i < v->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+                x->cell[i] = lval_ref(v->cell[i]);
             }
             break;
+        case LVAL_VEC:
+            x->vec = v->vec;
+            x->vcount = v->vcount;
+            if (x->vec) { lvec_ref(x->vec); }
+            break;
+        case LVAL_BIG:
+            x->limb = malloc(sizeof(uint32_t) * v->nlimb);
+            memcpy(x->limb, v->limb, sizeof(uint32_t) * v->nlimb);
+            x->nlimb = v->nlimb;
+            x->sign = v->sign;
+            break;
+        case LVAL_ARR:
+            x->ints = malloc(sizeof(long) * (v->acount ? v->acount : 1));
+            memcpy(x->ints, v->ints, sizeof(long) * v->acount);
+            x->acount = v->acount;
+            x->akind = v->akind;
+            break;
+        case LVAL_MAT:
+            x->rows = v->rows;
+            x->cols = v->cols;
+            x->mat = malloc(sizeof(double) * (x->rows * x->cols + 1));
+            memcpy(x->mat, v->mat, sizeof(double) * x->rows * x->cols);
+            break;
+        case LVAL_MAP:
+            x->map = v->map;
+            x->mcount = v->mcount;
+            if (x->map) { lmap_ref(x->map); }
+            break;
     }
 
+    if (lval_traced(x)) { lgc_track(&x->gc, LGC_LVAL); }
+
     return x;
 }
 
-lval* buildtin_op(lenv* e, lval* a, char* op) {
-
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_NUM, 
-            "Cannot operate on non-number! Got %s, Expected %s.",
-            ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
-    }
-
-    lval* x = lval_pop(a, 0);
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
-    }
-
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) { 
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division By Zero!");
-                break;
+lval* lval_unshare(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return v; }
+    if (v->ref == 1 && !lval_consed(v)) {
+        if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return v; }
+        /* about to be changed in place, so code compiled from it is stale */
+        if (v->code) {
+            lvm_free(v->code);
+            v->code = NULL;
+        }
+        /* and a slice needs cells of its own */
+        if (v->base) {
+            lval** cell = lcell_alloc(v->count);
+            for (int i = 0; i < v->count; i++) {
+                cell[i] = lval_ref(v->cell[i]);
             }
-            x->num /= y->num; 
+            lval_del(v->base);
+            v->base = NULL;
+            v->cell = cell;
         }
-
-        lval_del(y);
+        return v;
     }
+    lval* x = lval_copy(v);
+    v->ref--;
+    return x;
+}
 
-    lval_del(a);
+lval* buildtin_op(lenv* e, lval* a, char* op) {
+    switch (op[0]) {
+        case '+': return builtin_add(e, a);
+        case '-': return builtin_sub(e, a);
+        case '*': return builtin_mul(e, a);
+        default:  return builtin_div(e, a);
+    }
+}
 
+/*
+ * Returns the cells of v from i on as a Q-Expression that shares v's
+ * array instead of copying it, consuming v. The slice holds the node that
+ * owns the array, which cannot change it while shared, and gets cells of
+ * its own from lval_unshare once it is itself about to change.
+ */
+lval* lval_slice(lval* v, int i) {
+    lval* x = lval_qexpr();
+    if (i < v->count) {
+        x->count = v->count - i;
+        x->cell = v->cell + i;
+        x->base = lval_ref(v->base ? v->base : v);
+    }
+    lval_del(v);
     return x;
 }
 
@@ -338,22 +678,20 @@ lval* buildtin_head(lenv* e, lval* a) {
         "Function 'head' passed too many arguments!"
         "Got %i, Expected %i.",
         a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
         "Function 'head' passed incorrect type for argument 0. "
         "Got %s, Expected %s.",
-        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+        ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR));
     LASSERT(a, a->cell[0]->count != 0, 
         "Function 'head' passed {}!"
         "Got %i, Expect %i.",
         a->cell[0]->count, 0);
 
     lval* v = lval_take(a, 0);
+    lval* x = lval_add(lval_qexpr(), lval_ref(v->cell[0]));
+    lval_del(v);
 
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
-    }
-
-    return v;
+    return x;
 }
 
 lval* buildtin_tail(lenv* e, lval* a) {
@@ -362,20 +700,16 @@ lval* buildtin_tail(lenv* e, lval* a) {
         "Function 'tail' passed too many arguments!"
         "Got %i, Expected %i.",
         a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
         "Function 'tail' passed incorrect type for argument 0. "
         "Got %s, Expected %s.",
-        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+        ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR));
     LASSERT(a, a->cell[0]->count != 0, 
         "Function 'tail' passed {}!"
         "Got %i, Expect %i.",
         a->cell[0]->count, 0);
 
-    lval* v = lval_take(a, 0);
-
-    lval_del(lval_pop(v, 0));
-
-    return v;
+    return lval_slice(lval_take(a, 0), 1);
 }
 
 lval* buildtin_list(lenv* e, lval* a) {
@@ -388,20 +722,37 @@ lval* buildtin_eval(lenv* e, lval* a) {
         "Function 'eval' passed too many arguments!"
         "Got %i, Expected %i.",
         a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
         "Function 'eval' passed incorrect type for argument 0. "
         "Got %s, Expected %s.",
-        ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+        ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR));
 
-    lval* x = lval_take(a, 0);
+    lval* x = lval_unshare(lval_take(a, 0));
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
 
+/*
+ * Appends the cells of y to x in one resize. When nothing else holds y
+ * its cells are moved over with a single memcpy instead of referenced
+ * one by one.
+ */
 lval* lval_join(lval* x, lval* y) {
 
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    x = lval_unshare(x);
+    int n = x->count;
+    x->cell = lcell_realloc(x->cell, n, n + y->count);
+    x->count = n + y->count;
+
+    if (y->ref == 1 && !y->base && y->count) {
+        memcpy(x->cell + n, y->cell, sizeof(lval*) * y->count);
+        lcell_free(y->cell, y->count);
+        y->cell = NULL;
+        y->count = 0;
+    } else {
+        for (int i = 0; i < y->count; i++) {
+            x->cell[n + i] = lval_ref(y->cell[i]);
+        }
     }
 
     lval_del(y);
@@ -412,23 +763,432 @@ lval* lval_join(lval* x, lval* y) {
 lval* buildtin_join(lenv* e, lval* a) {
 
     for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR, 
+        LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR, 
             "Function 'join' passed incorrect type!"
             "Got %s, Expect %s.",
-            ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+            ltype_name(lval_type(a->cell[i])), ltype_name(LVAL_QEXPR));
+    }
+
+    lval* x = a->cell[0];
+    for (int i = 1; i < a->count; i++) {
+        x = lval_join(x, a->cell[i]);
+    }
+
+    lcell_free(a->cell, a->count);
+    a->cell = NULL;
+    a->count = 0;
+    lval_del(a);
+
+    return x;
+}
+
+lval* buildtin_vec(lenv* e, lval* a) {
+    LASSERT_NUM("vec", a, 1);
+    LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    lval* v = lval_vec();
+    for (int i = 0; i < q->count; i++) {
+        v = lvec_conj(v, lval_ref(q->cell[i]));
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* buildtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 1, LVAL_NUM);
+    if (lval_type(a->cell[0]) == LVAL_ARR) {
+        LASSERT_INDEX("nth", a, 1, a->cell[0]->acount);
+        lval* x = larr_nth(a->cell[0], lval_long(a->cell[1]));
+        lval_del(a);
+        return x;
+    }
+    LASSERT_TYPE("nth", a, 0, LVAL_VEC);
+    LASSERT_INDEX("nth", a, 1, a->cell[0]->vcount);
+
+    lval* x = lval_ref(lvec_nth(a->cell[0], lval_long(a->cell[1])));
+    lval_del(a);
+    return x;
+}
+
+lval* buildtin_assoc(lenv* e, lval* a) {
+    LASSERT_NUM("assoc", a, 3);
+    if (lval_type(a->cell[0]) == LVAL_MAP) {
+        lval* v = lval_pop(a, 2);
+        lval* k = lval_pop(a, 1);
+        return lmap_assoc(lval_take(a, 0), k, v);
+    }
+    LASSERT_TYPE("assoc", a, 0, LVAL_VEC);
+    LASSERT_TYPE("assoc", a, 1, LVAL_NUM);
+    LASSERT_INDEX("assoc", a, 1, a->cell[0]->vcount);
+
+    int i = lval_long(a->cell[1]);
+    lval* x = lval_pop(a, 2);
+    lval* v = lval_take(a, 0);
+    return lvec_assoc(v, i, x);
+}
+
+lval* buildtin_conj(lenv* e, lval* a) {
+    LASSERT(a, a->count > 0, "Function 'conj' passed no arguments.");
+    LASSERT_TYPE("conj", a, 0, LVAL_VEC);
+
+    lval* v = lval_pop(a, 0);
+    for (int i = 0; i < a->count; i++) {
+        v = lvec_conj(v, lval_ref(a->cell[i]));
     }
+    lval_del(a);
+    return v;
+}
 
-    lval* x = lval_pop(a, 0);
+lval* buildtin_slice(lenv* e, lval* a) {
+    LASSERT_NUM("slice", a, 3);
+    LASSERT_TYPE("slice", a, 0, LVAL_VEC);
+    LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 2, LVAL_NUM);
+    LASSERT(a, 0 <= lval_long(a->cell[1])
+        && lval_long(a->cell[1]) <= lval_long(a->cell[2])
+        && lval_long(a->cell[2]) <= a->cell[0]->vcount,
+        "Function 'slice' passed range %li to %li out of range for %i elements.",
+        lval_long(a->cell[1]), lval_long(a->cell[2]), a->cell[0]->vcount);
+
+    int from = lval_long(a->cell[1]);
+    int to = lval_long(a->cell[2]);
+    return lvec_slice(lval_take(a, 0), from, to);
+}
+
+lval* buildtin_concat(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("concat", a, i, LVAL_VEC);
+    }
 
+    lval* v = lval_vec();
     while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+        v = lvec_concat(v, lval_pop(a, 0));
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* buildtin_len(lenv* e, lval* a) {
+    LASSERT_NUM("len", a, 1);
+    if (lval_type(a->cell[0]) == LVAL_QEXPR) {
+        lval* x = lval_num(a->cell[0]->count);
+        lval_del(a);
+        return x;
+    }
+    LASSERT_TYPE("len", a, 0, LVAL_VEC);
+
+    lval* x = lval_num(a->cell[0]->vcount);
+    lval_del(a);
+    return x;
+}
+
+lval* buildtin_hash_map(lenv* e, lval* a) {
+    LASSERT_NUM("hash-map", a, 1);
+    LASSERT_TYPE("hash-map", a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count % 2 == 0,
+        "Function 'hash-map' passed %i items, not key and value pairs.",
+        a->cell[0]->count);
+
+    lval* q = a->cell[0];
+    lval* m = lval_map();
+    for (int i = 0; i < q->count; i += 2) {
+        m = lmap_assoc(m, lval_ref(q->cell[i]), lval_ref(q->cell[i+1]));
+    }
+    lval_del(a);
+    return m;
+}
+
+lval* buildtin_get(lenv* e, lval* a) {
+    LASSERT_NUM("get", a, 2);
+    LASSERT_TYPE("get", a, 0, LVAL_MAP);
+
+    lval* x = lmap_get(a->cell[0], a->cell[1]);
+    x = x ? lval_ref(x) : lval_sexpr();
+    lval_del(a);
+    return x;
+}
+
+lval* buildtin_dissoc(lenv* e, lval* a) {
+    LASSERT_NUM("dissoc", a, 2);
+    LASSERT_TYPE("dissoc", a, 0, LVAL_MAP);
+
+    lval* k = lval_pop(a, 1);
+    lval* m = lmap_dissoc(lval_take(a, 0), k);
+    lval_del(k);
+    return m;
+}
+
+lval* buildtin_keys(lenv* e, lval* a) {
+    LASSERT_NUM("keys", a, 1);
+    LASSERT_TYPE("keys", a, 0, LVAL_MAP);
+
+    lval* q = lmap_items(a->cell[0], 1);
+    lval_del(a);
+    return q;
+}
+
+static double lval_as_dbl(lval* x) {
+    switch (lval_type(x)) {
+        case LVAL_DBL: return lval_double(x);
+        case LVAL_BIG: return lbig_dbl(x);
+        default:       return lval_long(x);
+    }
+}
+
+lval* buildtin_i64(lenv* e, lval* a) {
+    LASSERT_NUM("i64", a, 1);
+    LASSERT_TYPE("i64", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_type(q->cell[i]) == LVAL_NUM,
+            "Function 'i64' passed %s for element %i, not a Number.",
+            ltype_name(lval_type(q->cell[i])), i);
+    }
+
+    lval* v = lval_arr(LARR_I64, q->count);
+    for (int i = 0; i < q->count; i++) { v->ints[i] = lval_long(q->cell[i]); }
+    lval_del(a);
+    return v;
+}
+
+lval* buildtin_f64(lenv* e, lval* a) {
+    LASSERT_NUM("f64", a, 1);
+    if (lval_type(a->cell[0]) == LVAL_ARR) {
+        lval* v = larr_f64(a->cell[0]);
+        lval_del(a);
+        return v;
+    }
+    LASSERT_TYPE("f64", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    for (int i = 0; i < q->count; i++) {
+        int t = lval_type(q->cell[i]);
+        LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_DBL,
+            "Function 'f64' passed %s for element %i, not a Number.",
+            ltype_name(t), i);
+    }
+
+    lval* v = lval_arr(LARR_F64, q->count);
+    for (int i = 0; i < q->count; i++) { v->dbls[i] = lval_as_dbl(q->cell[i]); }
+    lval_del(a);
+    return v;
+}
+
+lval* buildtin_iota(lenv* e, lval* a) {
+    LASSERT_NUM("iota", a, 1);
+    LASSERT_TYPE("iota", a, 0, LVAL_NUM);
+    LASSERT(a, lval_long(a->cell[0]) >= 0 && lval_long(a->cell[0]) <= INT_MAX,
+        "Function 'iota' passed %li, not a length.", lval_long(a->cell[0]));
+
+    lval* v = lval_arr(LARR_I64, lval_long(a->cell[0]));
+    for (int i = 0; i < v->acount; i++) { v->ints[i] = i; }
+    lval_del(a);
+    return v;
+}
+
+lval* buildtin_vsum(lenv* e, lval* a) {
+    LASSERT_NUM("vsum", a, 1);
+    LASSERT_TYPE("vsum", a, 0, LVAL_ARR);
+
+    lval* x = larr_sum(a->cell[0]);
+    lval_del(a);
+    return x;
+}
+
+lval* buildtin_vdot(lenv* e, lval* a) {
+    LASSERT_NUM("vdot", a, 2);
+    LASSERT_TYPE("vdot", a, 0, LVAL_ARR);
+    LASSERT_TYPE("vdot", a, 1, LVAL_ARR);
+    LASSERT(a, a->cell[0]->acount == a->cell[1]->acount,
+        "Function 'vdot' passed arrays of %i and %i elements.",
+        a->cell[0]->acount, a->cell[1]->acount);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    lval* r;
+    if (x->akind == y->akind) {
+        r = larr_dot(x, y);
+    } else {
+        x = larr_f64(x);
+        y = larr_f64(y);
+        r = larr_dot(x, y);
+        lval_del(x);
+        lval_del(y);
+    }
+    lval_del(a);
+    return r;
+}
+
+static lval* buildtin_vext(lenv* e, lval* a, char* func, int max) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_ARR);
+    LASSERT(a, a->cell[0]->acount > 0, "Function '%s' passed an empty array.", func);
+
+    lval* x = larr_min(a->cell[0], max);
+    lval_del(a);
+    return x;
+}
+
+lval* buildtin_vmin(lenv* e, lval* a) {
+    return buildtin_vext(e, a, "vmin", 0);
+}
+
+lval* buildtin_vmax(lenv* e, lval* a) {
+    return buildtin_vext(e, a, "vmax", 1);
+}
+
+/*
+ * Adds two arrays of the same length, or a number to every element of
+ * an array. The result holds doubles if either side does.
+ */
+lval* buildtin_vmap_add(lenv* e, lval* a) {
+    LASSERT_NUM("vmap+", a, 2);
+    if (lval_type(a->cell[0]) != LVAL_ARR) {
+        lval* t = a->cell[0];
+        a->cell[0] = a->cell[1];
+        a->cell[1] = t;
+    }
+    LASSERT_TYPE("vmap+", a, 0, LVAL_ARR);
+
+    lval* x = lval_ref(a->cell[0]);
+    lval* y = a->cell[1];
+    int step = 1;
+    if (lval_type(y) == LVAL_ARR) {
+        LASSERT(a, x->acount == y->acount,
+            "Function 'vmap+' passed arrays of %i and %i elements.",
+            x->acount, y->acount);
+        lval_ref(y);
+    } else {
+        LASSERT(a, lval_type(y) == LVAL_NUM || lval_type(y) == LVAL_DBL,
+            "Function 'vmap+' passed %s, not a Number or Array.",
+            ltype_name(lval_type(y)));
+        step = 0;
+        if (lval_type(y) == LVAL_NUM) {
+            long k = lval_long(y);
+            y = lval_arr(LARR_I64, 1);
+            y->ints[0] = k;
+        } else {
+            double k = lval_double(y);
+            y = lval_arr(LARR_F64, 1);
+            y->dbls[0] = k;
+        }
+    }
+    lval_del(a);
+
+    if (x->akind != y->akind) {
+        lval* t = larr_f64(x);
+        lval_del(x);
+        x = t;
+        t = larr_f64(y);
+        lval_del(y);
+        y = t;
     }
+    lval* r = larr_add(x, y, step);
+    lval_del(x);
+    lval_del(y);
+    return r ? r : lval_err("Function 'vmap+' overflowed a 64-bit element.");
+}
 
+/* (matrix arr rows cols) fills a matrix row by row from a typed array. */
+static lval* buildtin_matrix_of(lenv* e, lval* a) {
+    LASSERT_NUM("matrix", a, 3);
+    LASSERT_TYPE("matrix", a, 1, LVAL_NUM);
+    LASSERT_TYPE("matrix", a, 2, LVAL_NUM);
+
+    lval* v = a->cell[0];
+    long rows = lval_long(a->cell[1]);
+    long cols = lval_long(a->cell[2]);
+    LASSERT(a, lmat_fits(rows, cols),
+        "Function 'matrix' passed %li by %li, too large for a matrix.",
+        rows, cols);
+    LASSERT(a, rows * cols == v->acount,
+        "Function 'matrix' passed %li by %li for an array of %i elements.",
+        rows, cols, v->acount);
+
+    v = larr_f64(v);
+    lval* m = lval_mat(rows, cols);
+    memcpy(m->mat, v->dbls, sizeof(double) * v->acount);
+    lval_del(v);
     lval_del(a);
+    return m;
+}
+
+lval* buildtin_matrix(lenv* e, lval* a) {
+    if (a->count && lval_type(a->cell[0]) == LVAL_ARR) { return buildtin_matrix_of(e, a); }
+    LASSERT_NUM("matrix", a, 1);
+    LASSERT_TYPE("matrix", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    int cols = 0;
+    if (q->count && lval_type(q->cell[0]) == LVAL_QEXPR) { cols = q->cell[0]->count; }
+    LASSERT(a, lmat_fits(q->count, cols),
+        "Function 'matrix' passed %i by %i, too large for a matrix.",
+        q->count, cols);
+    for (int i = 0; i < q->count; i++) {
+        lval* row = q->cell[i];
+        LASSERT(a, lval_type(row) == LVAL_QEXPR && row->count == cols,
+            "Function 'matrix' passed row %i that is not a Q-Expression of %i numbers.",
+            i, cols);
+        for (int j = 0; j < cols; j++) {
+            int t = lval_type(row->cell[j]);
+            LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_DBL,
+                "Function 'matrix' passed %s at row %i column %i, not a Number.",
+                ltype_name(t), i, j);
+        }
+    }
+
+    lval* m = lval_mat(q->count, cols);
+    for (int i = 0; i < q->count; i++) {
+        for (int j = 0; j < cols; j++) {
+            m->mat[i * cols + j] = lval_as_dbl(q->cell[i]->cell[j]);
+        }
+    }
+    lval_del(a);
+    return m;
+}
 
+lval* buildtin_mref(lenv* e, lval* a) {
+    LASSERT_NUM("mref", a, 3);
+    LASSERT_TYPE("mref", a, 0, LVAL_MAT);
+    LASSERT_TYPE("mref", a, 1, LVAL_NUM);
+    LASSERT_TYPE("mref", a, 2, LVAL_NUM);
+    LASSERT_INDEX("mref", a, 1, a->cell[0]->rows);
+    LASSERT_INDEX("mref", a, 2, a->cell[0]->cols);
+
+    lval* m = a->cell[0];
+    lval* x = lval_dbl(m->mat[lval_long(a->cell[1]) * m->cols + lval_long(a->cell[2])]);
+    lval_del(a);
     return x;
 }
 
+lval* buildtin_transpose(lenv* e, lval* a) {
+    LASSERT_NUM("transpose", a, 1);
+    LASSERT_TYPE("transpose", a, 0, LVAL_MAT);
+
+    lval* t = lmat_transpose(a->cell[0]);
+    lval_del(a);
+    return t;
+}
+
+lval* buildtin_mmul(lenv* e, lval* a) {
+    LASSERT_NUM("mmul", a, 2);
+    LASSERT_TYPE("mmul", a, 0, LVAL_MAT);
+    LASSERT_TYPE("mmul", a, 1, LVAL_MAT);
+    LASSERT(a, a->cell[0]->cols == a->cell[1]->rows,
+        "Function 'mmul' passed %ix%i and %ix%i matrices.",
+        a->cell[0]->rows, a->cell[0]->cols, a->cell[1]->rows, a->cell[1]->cols);
+    LASSERT(a, lmat_fits(a->cell[0]->rows, a->cell[1]->cols),
+        "Function 'mmul' would make a %ix%i matrix, which is too large.",
+        a->cell[0]->rows, a->cell[1]->cols);
+
+    lval* r = lmat_mul(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return r;
+}
+
 lval* buildtin(lenv* e, lval* a, char* func) {
     if (strcmp("list", func) == 0) { return buildtin_list(e, a); }
     if (strcmp("join", func) == 0) { return buildtin_join(e, a); }
@@ -440,20 +1200,129 @@ lval* buildtin(lenv* e, lval* a, char* func) {
     return lval_err("Unknow Function!");
 }
 
+/*
+ * Returns r, stored in the first argument rather than a new node when it
+ * is too big for a fixnum and that argument is a boxed number nothing
+ * else holds.
+ */
+static lval* lval_op_result(lval* a, long r) {
+    lval* x = a->cell[0];
+    if (LVAL_FIXNUM(x) || x->ref > 1 || (r >= LFIXNUM_MIN && r <= LFIXNUM_MAX)) {
+        lval_del(a);
+        return lval_num(r);
+    }
+    a->cell[0] = lval_num(0);
+    x->num = r;
+    lval_del(a);
+    return x;
+}
+
+/* Applies op to all of a in doubles, once any argument is a double. */
+static lval* lval_op_dbl(lval* a, int op) {
+    double r = lval_as_dbl(a->cell[0]);
+    if (op == '-' && a->count == 1) { r = -r; }
+    for (int i = 1; i < a->count; i++) {
+        double x = lval_as_dbl(a->cell[i]);
+        switch (op) {
+            case '+': r += x; break;
+            case '-': r -= x; break;
+            case '*': r *= x; break;
+            case '/':
+                LASSERT(a, x != 0, "Division By Zero!");
+                r /= x;
+                break;
+        }
+    }
+    lval_del(a);
+    return lval_dbl(r);
+}
+
+/*
+ * Finishes op from argument i on, with acc the result so far, once the
+ * arguments are not all longs or a long overflows: in doubles if any
+ * argument is one, else in big numbers.
+ */
+static lval* lval_op_wide(lval* a, int op, int i, lval* acc) {
+    for (int j = 0; j < a->count; j++) {
+        if (lval_type(a->cell[j]) == LVAL_DBL) {
+            lval_del(acc);
+            return lval_op_dbl(a, op);
+        }
+    }
+    return lbig_fold(a, op, i, acc);
+}
+
+/*
+ * Each operator works on longs until a step overflows or meets another
+ * kind of number, then hands the rest to lval_op_wide.
+ */
 lval* builtin_add(lenv* e, lval* a) {
-  return buildtin_op(e, a, "+");
+    LASSERT_NUMS("+", a);
+    long r = 0;
+    for (int i = 0; i < a->count; i++) {
+        lval* x = a->cell[i];
+        long t;
+        if (lval_type(x) != LVAL_NUM || __builtin_add_overflow(r, lval_long(x), &t)) {
+            return lval_op_wide(a, '+', i, lval_num(r));
+        }
+        r = t;
+    }
+    return lval_op_result(a, r);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-  return buildtin_op(e, a, "-");
+    LASSERT_NUMS("-", a);
+    lval* x = a->cell[0];
+    if (a->count == 1) {
+        if (lval_type(x) != LVAL_NUM || lval_long(x) == LONG_MIN) {
+            return lval_op_wide(a, '-', 0, lval_num(0));
+        }
+        return lval_op_result(a, -lval_long(x));
+    }
+    if (lval_type(x) != LVAL_NUM) { return lval_op_wide(a, '-', 1, lval_ref(x)); }
+
+    long r = lval_long(x);
+    for (int i = 1; i < a->count; i++) {
+        x = a->cell[i];
+        long t;
+        if (lval_type(x) != LVAL_NUM || __builtin_sub_overflow(r, lval_long(x), &t)) {
+            return lval_op_wide(a, '-', i, lval_num(r));
+        }
+        r = t;
+    }
+    return lval_op_result(a, r);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-  return buildtin_op(e, a, "*");
+    LASSERT_NUMS("*", a);
+    long r = 1;
+    for (int i = 0; i < a->count; i++) {
+        lval* x = a->cell[i];
+        long t;
+        if (lval_type(x) != LVAL_NUM || __builtin_mul_overflow(r, lval_long(x), &t)) {
+            return lval_op_wide(a, '*', i, lval_num(r));
+        }
+        r = t;
+    }
+    return lval_op_result(a, r);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-  return buildtin_op(e, a, "/");
+    LASSERT_NUMS("/", a);
+    lval* x = a->cell[0];
+    if (lval_type(x) != LVAL_NUM) { return lval_op_wide(a, '/', 1, lval_ref(x)); }
+
+    long r = lval_long(x);
+    for (int i = 1; i < a->count; i++) {
+        x = a->cell[i];
+        if (lval_type(x) != LVAL_NUM || (r == LONG_MIN && lval_long(x) == -1)) {
+            return lval_op_wide(a, '/', i, lval_num(r));
+        }
+        long n = lval_long(x);
+        LASSERT(a, n != 0, "Division By Zero!");
+        r /= n;
+    }
+    return lval_op_result(a, r);
 }
 
 lval* buildtin_gt(lenv* e, lval* a) {
@@ -482,56 +1351,208 @@ lval* buildtin_ne(lenv* e, lval* a) {
 
 lval* buildtin_ord(lenv* e, lval* a, char* op) {
     LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
+    LASSERT_NUMS(op, a);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    int c;
+    if (lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+        double p = lval_as_dbl(x);
+        double q = lval_as_dbl(y);
+        c = (p > q) - (p < q);
+    } else {
+        c = lbig_cmp(x, y);
+    }
     int r;
     if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
+        r = c > 0;
     }
 
     if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num < a->cell[1]->num);
+        r = c < 0;
     }
 
     if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
+        r = c >= 0;
     }
 
     if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
+        r = c <= 0;
     }
 
     lval_del(a);
     return lval_num(r);
 }
 
+/* Whether d is a whole number a long can hold, stored in *n. */
+static int lval_dbl_long(double d, long* n) {
+    if (!(d >= -0x1p63 && d < 0x1p63)) { return 0; }
+    *n = (long)d;
+    return (double)*n == d;
+}
+
+/* A number and a double are equal when the double is that whole number. */
+static int lval_eq_mixed(lval* x, lval* y) {
+    if (lval_type(x) == LVAL_DBL) {
+        lval* t = x;
+        x = y;
+        y = t;
+    }
+    long n;
+    return lval_type(x) == LVAL_NUM && lval_type(y) == LVAL_DBL
+        && lval_dbl_long(lval_double(y), &n) && n == lval_long(x);
+}
+
 int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) { return 0; }
+    int base = lwalk_count;
+    int eq = 1;
+    lwalk_push(x, y, 0);
+
+    while (eq && lwalk_count > base) {
+        lwalk_count--;
+        x = lwalk_stack[lwalk_count].v;
+        y = lwalk_stack[lwalk_count].w;
+        if (lval_type(x) != lval_type(y)) { eq = lval_eq_mixed(x, y); continue; }
+        if (x == y) { continue; }
+        /* two interned strings are one copy when equal; lists may still be == */
+        if (lval_type(x) == LVAL_STR && lval_consed(x) && lval_consed(y)) { eq = 0; break; }
+
+        switch (lval_type(x)) {
+            case LVAL_NUM: eq = lval_long(x) == lval_long(y); break;
+            case LVAL_DBL: eq = lval_double(x) == lval_double(y); break;
+            case LVAL_ARR: eq = larr_eq(x, y); break;
+            case LVAL_MAT: eq = lmat_eq(x, y); break;
+            case LVAL_BIG:
+                eq = x->sign == y->sign && x->nlimb == y->nlimb
+                    && memcmp(x->limb, y->limb, sizeof(uint32_t) * x->nlimb) == 0;
+                break;
+            case LVAL_ERR: eq = (strcmp(x->err, y->err) == 0); break;
+            case LVAL_SYM: eq = x->sym == y->sym; break;
+            case LVAL_STR: eq = (strcmp(x->str, y->str) == 0); break;
+            case LVAL_FUN:
+                if (x->buildtin || y->buildtin) {
+                    eq = x->buildtin == y->buildtin;
+                } else {
+                    lwalk_push(x->body, y->body, 0);
+                    lwalk_push(x->formals, y->formals, 0);
+                }
+                break;
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                if (x->count != y->count) { eq = 0; break; }
+                for (int i = x->count - 1; i >= 0; i--) {
+                    lwalk_push(x->cell[i], y->cell[i], 0);
+                }
+                break;
+            case LVAL_VEC:
+                if (x->vcount != y->vcount) { eq = 0; break; }
+                for (int i = x->vcount - 1; i >= 0; i--) {
+                    lwalk_push(lvec_nth(x, i), lvec_nth(y, i), 0);
+                }
+                break;
+            case LVAL_MAP:
+                if (x->mcount != y->mcount) { eq = 0; break; }
+                lval* items = lmap_items(x, 0);
+                for (int i = 0; eq && i < items->count; i += 2) {
+                    lval* v = lmap_get(y, items->cell[i]);
+                    if (v) {
+                        lwalk_push(items->cell[i+1], v, 0);
+                    } else {
+                        eq = 0;
+                    }
+                }
+                lval_del(items);
+                break;
+        }
+    }
 
-    switch (x->type) {
-        case LVAL_NUM: return x->num == y->num;
-        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        case LVAL_FUN: 
-            if (x->buildtin || y->buildtin) {
-                return x->buildtin == y->buildtin;
-            } else {
-                return lval_eq(x->formals, y->formals) 
-                    && lval_eq(x->body, y->body);
-            }
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if (x->count != y->count) { return 0; }
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[i], y->cell[i])) {
-                    return 0;
+    lwalk_count = base;
+    return eq;
+}
+
+static unsigned lhash_str(char* s) {
+    unsigned h = 2166136261u;
+    while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+    return h;
+}
+
+/*
+ * Hashes v so that values lval_eq finds equal hash the same, walking its
+ * children from the walk stack as lval_eq does.
+ */
+unsigned lval_hash(lval* v) {
+    int base = lwalk_count;
+    unsigned h = 2166136261u;
+    lwalk_push(v, NULL, 0);
+
+    while (lwalk_count > base) {
+        v = lwalk_stack[--lwalk_count].v;
+        unsigned x = 0;
+        int t = lval_type(v);
+
+        switch (t) {
+            case LVAL_NUM: x = (unsigned)lval_long(v) ^ (unsigned)(lval_long(v) >> 32); break;
+            case LVAL_DBL: {
+                /* whole numbers hash as the equal long does, and -0.0 as 0 */
+                long n;
+                double d = lval_double(v);
+                if (lval_dbl_long(d, &n)) {
+                    x = (unsigned)n ^ (unsigned)(n >> 32);
+                    t = LVAL_NUM;
+                } else {
+                    uint64_t b;
+                    memcpy(&b, &d, sizeof(b));
+                    x = (unsigned)b ^ (unsigned)(b >> 32);
                 }
+                break;
             }
-            return 1;
+            case LVAL_BIG:
+                x = v->sign;
+                for (int i = 0; i < v->nlimb; i++) { x = (x ^ v->limb[i]) * 16777619u; }
+                break;
+            case LVAL_ERR: x = lhash_str(v->err); break;
+            case LVAL_SYM: x = lhash_str(v->sym); break;
+            case LVAL_STR: x = lhash_str(v->str); break;
+            case LVAL_FUN:
+                if (v->buildtin) {
+                    x = (unsigned)(uintptr_t)v->buildtin;
+                } else {
+                    lwalk_push(v->body, NULL, 0);
+                    lwalk_push(v->formals, NULL, 0);
+                }
+                break;
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                x = v->count;
+                for (int i = v->count - 1; i >= 0; i--) {
+                    lwalk_push(v->cell[i], NULL, 0);
+                }
+                break;
+            case LVAL_VEC:
+                x = v->vcount;
+                for (int i = v->vcount - 1; i >= 0; i--) {
+                    lwalk_push(lvec_nth(v, i), NULL, 0);
+                }
+                break;
+            case LVAL_MAP:
+                x = lmap_hash(v);
+                break;
+            case LVAL_ARR:
+                x = larr_hash(v);
+                break;
+            case LVAL_MAT:
+                x = lmat_hash(v);
+                break;
+        }
+        h = (h ^ (x + t)) * 16777619u;
     }
-    return 0;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
 }
 
 lval* buildtin_cmp(lenv* e, lval* a, char* op) {
@@ -556,43 +1577,111 @@ lval* buildtin_if(lenv* e, lval* a) {
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
     lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
 
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
+    if (lval_long(a->cell[0])) {
+        x = lval_unshare(lval_pop(a, 1));
     } else {
-        x = lval_eval(e, lval_pop(a, 2));
+        x = lval_unshare(lval_pop(a, 2));
     }
+    x->type = LVAL_SEXPR;
+    x = lval_eval(e, x);
 
     lval_del(a);
     return x;
 }
 
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lenv_alloc();
+    e->ref = 1;
     e->par = NULL;
+    e->top = e;
     e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
+    e->icap = 0;
+    e->index = NULL;
+    lgc_track(&e->gc, LGC_LENV);
+    return e;
+}
+
+lenv* lenv_ref(lenv* e) {
+    e->ref++;
     return e;
 }
 
 void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    while (e && --e->ref == 0) {
+        lenv* par = e->par;
+        lgc_untrack(&e->gc);
+
+        for (int i = 0; i < e->count; i++) {
+            if (e->top != e) { LSYM(e->syms[i])->frames--; }
+            lval_del(e->vals[i]);
+        }
+        free(e->index);
+        lenv_free(e);
+        e = par;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+static unsigned long lenv_hash(char* sym) {
+    unsigned long h = (uintptr_t)sym;
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15UL;
+    return h ^ (h >> 31);
+}
+
+static void lenv_index_add(lenv* e, int slot) {
+    unsigned long i = lenv_hash(e->syms[slot]) & (e->icap - 1);
+    while (e->index[i] >= 0) { i = (i + 1) & (e->icap - 1); }
+    e->index[i] = slot;
+}
+
+/*
+ * Small frames are searched linearly. Once an environment grows past
+ * LENV_LINEAR bindings it also gets an open-addressing index from the
+ * interned symbol to its slot in syms/vals, kept at most half full.
+ */
+static void lenv_reindex(lenv* e) {
+    if (e->count <= LENV_LINEAR || e->count * 2 <= e->icap) { return; }
+
+    free(e->index);
+    e->icap = e->icap ? e->icap * 2 : 4 * LENV_LINEAR;
+    while (e->count * 2 > e->icap) { e->icap *= 2; }
+    e->index = malloc(sizeof(int) * e->icap);
+    memset(e->index, -1, sizeof(int) * e->icap);
     for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+        lenv_index_add(e, i);
+    }
+}
+
+int lenv_find(lenv* e, char* sym) {
+    if (e->index) {
+        unsigned long i = lenv_hash(sym) & (e->icap - 1);
+        while (e->index[i] >= 0) {
+            if (e->syms[e->index[i]] == sym) { return e->index[i]; }
+            i = (i + 1) & (e->icap - 1);
         }
+        return -1;
+    }
+
+    for (int i = 0; i < e->count; i++) {
+        if (e->syms[i] == sym) { return i; }
+    }
+    return -1;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    if (LSYM(k->sym)->frames == 0 && e->top) {
+        e = e->top;
+    }
+
+    int i = k->slot;
+    if (i < 0 || i >= e->count || e->syms[i] != k->sym) {
+        i = lenv_find(e, k->sym);
+        /* no frame binds k, so remember where the global binding is */
+        if (i >= 0 && e == e->top && LSYM(k->sym)->frames == 0) { k->slot = i; }
+    }
+    if (i >= 0) {
+        return lval_ref(e->vals[i]);
     }
 
     if (e->par) {
@@ -603,24 +1692,39 @@ lval* lenv_get(lenv* e, lval* k) {
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    lenv_bind(e, k->sym, e->par ? lval_ref(v) : lval_cons(lgc_evacuate(v)));
+}
+
+static void lenv_grow(lenv* e, int n) {
+    if (n <= e->cap) { return; }
+
+    e->cap = e->cap ? e->cap * 2 : 4;
+    while (e->cap < n) { e->cap *= 2; }
+    e->syms = realloc(e->syms, sizeof(char*) * e->cap);
+    e->vals = realloc(e->vals, sizeof(lval*) * e->cap);
+}
+
+/* Binds sym to v in e itself, taking ownership of v. */
+void lenv_bind(lenv* e, char* sym, lval* v) {
+    int i = lenv_find(e, sym);
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = v;
+        return;
     }
 
+    lenv_grow(e, e->count + 1);
     e->count++;
 
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+    e->vals[e->count-1] = v;
+    e->syms[e->count-1] = sym;
+    if (e->top != e) { LSYM(sym)->frames++; }
 
-    
-    lval* tmp = lval_copy(v);
-    e->vals[e->count-1] = tmp;
-    e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count-1], k->sym);
+    if (e->index && e->count * 2 <= e->icap) {
+        lenv_index_add(e, e->count-1);
+    } else {
+        lenv_reindex(e);
+    }
 }
 
 void lenv_add_buildtin(lenv* e, char* name, lbuildtin func) {
@@ -646,6 +1750,37 @@ void lenv_add_buildtins(lenv* e) {
     lenv_add_buildtin(e, "join", buildtin_join);
     lenv_add_buildtin(e, "eval", buildtin_eval);
 
+    /* vector function */
+    lenv_add_buildtin(e, "vec",    buildtin_vec);
+    lenv_add_buildtin(e, "nth",    buildtin_nth);
+    lenv_add_buildtin(e, "assoc",  buildtin_assoc);
+    lenv_add_buildtin(e, "conj",   buildtin_conj);
+    lenv_add_buildtin(e, "slice",  buildtin_slice);
+    lenv_add_buildtin(e, "concat", buildtin_concat);
+    lenv_add_buildtin(e, "len",    buildtin_len);
+
+    /* map function */
+    lenv_add_buildtin(e, "hash-map", buildtin_hash_map);
+    lenv_add_buildtin(e, "get",      buildtin_get);
+    lenv_add_buildtin(e, "dissoc",   buildtin_dissoc);
+    lenv_add_buildtin(e, "keys",     buildtin_keys);
+
+    /* typed array function */
+    lenv_add_buildtin(e, "i64",   buildtin_i64);
+    lenv_add_buildtin(e, "f64",   buildtin_f64);
+    lenv_add_buildtin(e, "iota",  buildtin_iota);
+    lenv_add_buildtin(e, "vsum",  buildtin_vsum);
+    lenv_add_buildtin(e, "vdot",  buildtin_vdot);
+    lenv_add_buildtin(e, "vmin",  buildtin_vmin);
+    lenv_add_buildtin(e, "vmax",  buildtin_vmax);
+    lenv_add_buildtin(e, "vmap+", buildtin_vmap_add);
+
+    /* matrix function */
+    lenv_add_buildtin(e, "matrix",    buildtin_matrix);
+    lenv_add_buildtin(e, "mref",      buildtin_mref);
+    lenv_add_buildtin(e, "transpose", buildtin_transpose);
+    lenv_add_buildtin(e, "mmul",      buildtin_mmul);
+
     /* variable function */
     lenv_add_buildtin(e, "def", buildtin_def);
     lenv_add_buildtin(e, "=",   buildtin_put);
@@ -663,6 +1798,9 @@ void lenv_add_buildtins(lenv* e) {
     lenv_add_buildtin(e, "load",  buildtin_load);
     lenv_add_buildtin(e, "error", buildtin_error);
     lenv_add_buildtin(e, "print", buildtin_print);
+
+    /* memory function */
+    lenv_add_buildtin(e, "mem-stats", buildtin_mem_stats);
 }
 
 lval* buildtin_def(lenv* e, lval* a) {
@@ -677,10 +1815,10 @@ lval* buildtin_var(lenv* e, lval* a, char* func) {
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
     lval* syms = a->cell[0];
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM, 
+        LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM, 
             "Function 'def' cannot define non-symbol!"
             "Got %s, Expect %s.", 
-            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+            ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
     }
 
     LASSERT(a, syms->count == a->count-1, 
@@ -701,48 +1839,123 @@ lval* buildtin_var(lenv* e, lval* a, char* func) {
     return lval_sexpr(); 
 }
 
+/*
+ * The value of an S-Expression holding only x. That is x itself, unless
+ * x is a builtin taking no arguments, which is called instead, so that
+ * (mem-stats) works like a call.
+ */
+lval* lval_single(lenv* e, lval* x) {
+    if (lval_type(x) == LVAL_FUN && x->buildtin == buildtin_mem_stats) {
+        return lval_call(e, x, lval_sexpr());
+    }
+    return x;
+}
+
 lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->buildtin) { return f->buildtin(e, a); }
+    if (f->buildtin) {
+        lval* x = f->buildtin(e, a);
+        lval_del(f);
+        return x;
+    }
+
+    lval* x = lval_apply(e, f, a->cell, a->count);
+    lval_del(a);
+    return x;
+}
 
-    int given = a->count;
+/*
+ * Applies the lambda f to the n values in args, consuming f but not the
+ * values. Too few values give back f with those formals bound.
+ */
+lval* lval_apply(lenv* e, lval* f, lval** args, int n) {
     int total = f->formals->count;
 
-    while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("Function passed too many arguments. "
-                            "Got %i, Expected %i.", given, total);
+    if (n > total) {
+        lval_del(f);
+        return lval_err("Function passed too many arguments. "
+                        "Got %i, Expected %i.", n, total);
+    }
+
+    if (n < total) {
+        f = lval_unshare(f);
+        for (int i = 0; i < n; i++) {
+            lenv_bind(f->env, f->formals->cell[i]->sym, lval_ref(args[i]));
         }
+        f->formals = lval_unshare(f->formals);
+        for (int i = 0; i < n; i++) {
+            lval_del(lval_pop(f->formals, 0));
+        }
+        return f;
+    }
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_pop(a, 0);
+    lenv* frame = lenv_frame(e, f, args);
 
-        lenv_put(f->env, sym ,val);
-        lval_del(sym);
-        lval_del(val);
+    lval* x;
+    if (lvm_enabled) {
+        x = lvm_exec(frame, f->body);
+    } else {
+        x = buildtin_eval(frame, lval_add(lval_sexpr(), lval_ref(f->body)));
     }
+    lenv_del(frame);
+    lval_del(f);
+    return x;
+}
 
-    // for (int i = 0; i < a->count; i++) {
-    //     lenv_put(f->env, f->formals->cell[i], a->cell[i]);
-    // }
-
-    lval_del(a);
+/*
+ * Makes the frame for applying the lambda f to all of its arguments from
+ * e. Nothing is evaluated in e while the frame is alive, so when the
+ * frame rebinds every symbol e binds, e can never be seen through it and
+ * the frame hangs off e's parent instead. A loop written as a tail call
+ * then keeps one frame alive rather than one per iteration.
+ */
+lenv* lenv_frame(lenv* e, lval* f, lval** args) {
+    /* formals are bound in order, so the i-th formal lands in slot i of the frame */
+    lenv* frame = lenv_copy(f->env);
+    for (int i = 0; i < f->formals->count; i++) {
+        lenv_bind(frame, f->formals->cell[i]->sym, lval_ref(args[i]));
+    }
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return buildtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    if (e->top != e && e->par && e->count <= LENV_LINEAR) {
+        int i = 0;
+        while (i < e->count && lenv_find(frame, e->syms[i]) >= 0) { i++; }
+        if (i == e->count) { e = e->par; }
     }
 
-    return lval_copy(f);
+    if (frame->par) { lenv_del(frame->par); }
+    frame->par = lenv_ref(e);
+    frame->top = e->top;
+    return frame;
+}
+
+/*
+ * 'if' and 'eval' end by evaluating one of their arguments. When f is
+ * one of them and would accept args, returns the argument it would
+ * evaluate, so the caller can evaluate it in place of the call.
+ */
+lval* lval_tail_arg(lval* f, lval** args, int n) {
+    if (f->buildtin == buildtin_eval && n == 1
+        && lval_type(args[0]) == LVAL_QEXPR) {
+        return args[0];
+    }
+    if (f->buildtin == buildtin_if && n == 3
+        && lval_type(args[0]) == LVAL_NUM
+        && lval_type(args[1]) == LVAL_QEXPR
+        && lval_type(args[2]) == LVAL_QEXPR) {
+        return lval_long(args[0]) ? args[1] : args[2];
+    }
+    return NULL;
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
+    v->ref = 1;
     v->buildtin = NULL;
     v->env = lenv_new();
+    v->env->top = NULL;
     v->formals = formals;
     v->body = body;
+    lgc_track(&v->gc, LGC_LVAL);
     return v;
 }
 
@@ -753,31 +1966,77 @@ lval* buildtin_lambda(lenv* e, lval* a) {
     LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
     for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
             "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+            ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
     }
 
     lval* formals = lval_pop(a, 0);
     lval* body = lval_pop(a, 0);
     lval_del(a);
 
+    lval_resolve(formals, body);
+
     return lval_lambda(formals, body);
 }
 
+/*
+ * Annotates every symbol in body that names one of the formals with the
+ * frame slot that formal is bound to by lval_call, so lenv_get can index
+ * the frame directly. Scoping is dynamic, so a frame's parent is only
+ * known at call time and only frame-local addresses are resolved; the
+ * slot is a hint that lenv_get checks before using, which keeps it safe
+ * for bodies shared between lambdas or evaluated as data.
+ */
+void lval_resolve(lval* formals, lval* body) {
+    int base = lwalk_count;
+    lwalk_push(body, NULL, 0);
+
+    while (lwalk_count > base) {
+        lval* x = lwalk_stack[--lwalk_count].v;
+        switch (lval_type(x)) {
+            case LVAL_SYM:
+                x->slot = -1;
+                for (int i = 0; i < formals->count; i++) {
+                    if (formals->cell[i]->sym == x->sym) {
+                        x->slot = i;
+                        break;
+                    }
+                }
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                for (int i = 0; i < x->count; i++) {
+                    lwalk_push(x->cell[i], NULL, 0);
+                }
+                break;
+        }
+    }
+}
+
 lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
+    lenv* n = lenv_alloc();
+    n->ref = 1;
+    n->par = e->par ? lenv_ref(e->par) : NULL;
+    n->top = e->top == e ? n : e->top;
     n->count = e->count;
-    n->syms = malloc(sizeof(char*)*n->count);
-    n->vals = malloc(sizeof(lval*)*n->count);
+    lenv_grow(n, n->count);
     
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = e->syms[i];
+        n->vals[i] = lval_ref(e->vals[i]);
+        if (n->top != n) { LSYM(n->syms[i])->frames++; }
+    }
+
+    n->icap = e->icap;
+    n->index = NULL;
+    if (e->index) {
+        n->index = malloc(sizeof(int) * n->icap);
+        memcpy(n->index, e->index, sizeof(int) * n->icap);
     }
 
+    lgc_track(&n->gc, LGC_LENV);
+
     return n;
 }
 
@@ -789,8 +2048,10 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 }
 
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_STR;
+    v->ref = 1;
+    v->strhash = 0;
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
     return v;
@@ -804,6 +2065,15 @@ void lval_print_str(lval* v) {
     free(tmp);
 }
 
+/* The shortest digits that read back as x, always with a point or exponent. */
+void lval_print_dbl(double x) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", x);
+    if (strtod(buf, NULL) != x) { snprintf(buf, sizeof(buf), "%.17g", x); }
+    printf("%s", buf);
+    if (!strpbrk(buf, ".en")) { printf(".0"); }
+}
+
 lval* lval_read_str(mpc_ast_t* t) {
     t->contents[strlen(t->contents) - 1] = '\0';
     char* tmp = malloc(strlen(t->contents + 1) + 1);
@@ -811,7 +2081,7 @@ lval* lval_read_str(mpc_ast_t* t) {
     tmp = mpcf_unescape(tmp);
     lval* str = lval_str(tmp);
     free(tmp);
-    return str;
+    return lval_cons(str);
 }
 
 lval* buildtin_load(lenv* e, lval* a) {
@@ -824,9 +2094,11 @@ lval* buildtin_load(lenv* e, lval* a) {
         mpc_ast_delete(r.output);
 
         while (expr->count) {
+            lgc_form_begin();
             lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            if (lval_type(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
+            lgc_form_end();
         }
 
         lval_del(expr);
@@ -856,6 +2128,28 @@ lval* buildtin_print(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
+/* The allocation counters, as a map from their names to numbers. */
+lval* buildtin_mem_stats(lenv* e, lval* a) {
+    LASSERT_NUM("mem-stats", a, 0);
+
+    lval* cells = lval_qexpr();
+    lval* freed = lval_qexpr();
+    for (int k = 0; k < LCELL_CLASSES; k++) {
+        cells = lval_add(cells, lval_num(lmem.cells[k]));
+        freed = lval_add(freed, lval_num(lmem.cells_freed[k]));
+    }
+
+    lval* m = lval_map();
+    m = lmap_assoc(m, lval_str("nodes"), lval_num(lmem.nodes));
+    m = lmap_assoc(m, lval_str("nodes-freed"), lval_num(lmem.nodes_freed));
+    m = lmap_assoc(m, lval_str("slabs"), lval_num(lmem.slabs));
+    m = lmap_assoc(m, lval_str("cells"), cells);
+    m = lmap_assoc(m, lval_str("cells-freed"), freed);
+    m = lmap_assoc(m, lval_str("cells-large"), lval_num(lmem.cells_large));
+    lval_del(a);
+    return m;
+}
+
 lval* buildtin_error(lenv* e, lval* a) {
     LASSERT_NUM("error", a, 1);
     LASSERT_TYPE("error", a, 0, LVAL_STR);
@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 
 #include "mpc.h"
 
@@ -19,6 +23,17 @@ enum {
     LVAL_FUN,
     LVAL_SEXPR,
     LVAL_QEXPR,
+    LVAL_VEC,
+    LVAL_MAP,
+    LVAL_BIG,
+    LVAL_DBL,
+    LVAL_ARR,
+    LVAL_MAT,
+};
+
+enum {
+    LARR_I64,
+    LARR_F64,
 };
 
 enum {
@@ -27,54 +42,217 @@ enum {
     LERR_BAD_NUM,
 };
 
+enum {
+    LGC_LVAL,
+    LGC_LENV,
+};
+
+#define LCELL_CLASSES 8
+
+enum {
+    LGC_MARKSWEEP,
+    LGC_GENERATIONAL,
+    LGC_ARENA,
+};
+
 // struct lval;
 // struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lgc lgc;
+typedef struct lcode lcode;
+typedef struct ljit ljit;
+typedef struct lvec lvec;
+typedef struct lmap lmap;
 
 typedef lval*(*lbuildtin)(lenv*, lval*);
 
-struct lval {
-    int type;
-    long num;
-    char* err;
-    char* sym;
-    char* str;
+struct lgc {
+    lgc* next;
+    lgc* prev;
+    int refs;
+    char kind;
+    char mark;
+    char gen;
+    char block;
+};
 
-    lbuildtin buildtin;
+typedef struct {
+    long nodes;
+    long nodes_freed;
+    long slabs;
+    long cells[LCELL_CLASSES];
+    long cells_freed[LCELL_CLASSES];
+    long cells_large;
+} lmem_stats;
 
-    lenv* env;
-    lval* formals;
-    lval* body;
+extern __thread lmem_stats lmem;
 
-    int count;
-    struct lval** cell;
+struct lval {
+    lgc gc;
+    int type;
+    int ref;
+
+    union {
+        long num;
+        double dbl;
+        char* err;
+
+        struct {
+            char* str;
+            unsigned strhash;
+        };
+
+        struct {
+            char* sym;
+            int slot;
+        };
+
+        struct {
+            lbuildtin buildtin;
+            lenv* env;
+            lval* formals;
+            lval* body;
+        };
+
+        struct {
+            int count;
+            unsigned hash;
+            struct lval** cell;
+            lcode* code;
+            struct lval* base;
+        };
+
+        struct {
+            lvec* vec;
+            int vcount;
+        };
+
+        struct {
+            lmap* map;
+            int mcount;
+        };
+
+        struct {
+            uint32_t* limb;
+            int nlimb;
+            int sign;
+        };
+
+        struct {
+            union {
+                long* ints;
+                double* dbls;
+            };
+            int acount;
+            int akind;
+        };
+
+        struct {
+            double* mat;
+            int rows;
+            int cols;
+        };
+    };
 };
 
+#define LFIXNUM_MIN (LONG_MIN / 2)
+#define LFIXNUM_MAX (LONG_MAX / 2)
+#define LVAL_FIXNUM(v) ((uintptr_t)(v) & 1)
+#define LVAL_FLONUM(v) (((uintptr_t)(v) & 3) == 2)
+#define LVAL_IMMEDIATE(v) ((uintptr_t)(v) & 3)
+#define LFLONUM_ZERO ((uintptr_t)0x8000000000000002u)
+
+static inline int lval_type(lval* v) {
+    if (LVAL_FIXNUM(v)) { return LVAL_NUM; }
+    return LVAL_FLONUM(v) ? LVAL_DBL : v->type;
+}
+
+static inline long lval_long(lval* v) {
+    return LVAL_FIXNUM(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/*
+ * A flonum holds a double in the pointer itself, rotated so that the top
+ * bits of its exponent land at the bottom. Doubles of magnitude between
+ * about 1e-77 and 1e77 have those bits 011 or 100, which the lowest of
+ * them tells apart, so the other two can make room for the tag 10.
+ */
+static inline double lval_double(lval* v) {
+    if (!LVAL_FLONUM(v)) { return v->dbl; }
+    double d = 0;
+    uintptr_t b = (uintptr_t)v;
+    if (b != LFLONUM_ZERO) {
+        b = (2 - (b >> 63)) | (b & ~(uintptr_t)3);
+        b = (b >> 3) | (b << 61);
+        memcpy(&d, &b, sizeof(d));
+    }
+    return d;
+}
+
+/* Whether v is the one copy of its value kept by hash-consing. */
+static inline int lval_consed(lval* v) {
+    if (LVAL_IMMEDIATE(v)) { return 0; }
+    switch (v->type) {
+        case LVAL_STR:   return v->strhash != 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: return v->hash != 0;
+    }
+    return 0;
+}
+
+/*
+ * Interned symbol names carry the number of bindings they currently have
+ * in lambda frames. A symbol no frame binds can only be found in the
+ * global environment.
+ */
+typedef struct {
+    int frames;
+    char name[];
+} lsym;
+
+#define LSYM(s) ((lsym*)((s) - offsetof(lsym, name)))
+
+#define LENV_LINEAR 8
+
 struct lenv {
+    lgc gc;
+    int ref;
     lenv* par;
+    lenv* top;
     int count;
+    int cap;
     char** syms;
     lval** vals;
+
+    int icap;
+    int* index;
 };
 
 char* ltype_name(int t);
 
 lval* lval_num(long x);
+lval* lval_dbl(double x);
 lval* lval_err(char* fmt, ...);
+char* lsym_intern(char* s);
 lval* lval_sym(char* x);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
+lval* lval_vec(void);
+lval* lval_map(void);
 void lval_del(lval* v);
+lval* lval_ref(lval* v);
+lval* lval_copy(lval* v);
+lval* lval_unshare(lval* v);
 lval* lval_read_num(mpc_ast_t* t);
 lval* lval_read(mpc_ast_t* t);
-void lval_expr_print(lval* v, char open, char close);
 void lval_print(lval* v);
 void lval_println(lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
+lval* lval_slice(lval* v, int i);
 lval* buildtin_op(lenv* e, lval* a, char* op);
 lval* buildtin_head(lenv* e, lval* a);
 lval* buildtin_tail(lenv* e, lval* a);
@@ -95,9 +273,12 @@ lval* buildtin_def(lenv* e, lval* a);
 
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+lenv* lenv_ref(lenv* e);
 
 lval* lenv_get(lenv* e, lval* k);
+int lenv_find(lenv* e, char* sym);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_bind(lenv* e, char* sym, lval* v);
 
 void lenv_add_buildtin(lenv* e, char* name, lbuildtin func);
 void lenv_add_buildtins(lenv* e);
@@ -105,9 +286,14 @@ void lenv_add_buildtins(lenv* e);
 lval* buildtin_def(lenv* e, lval* a);
 lval* buildtin_put(lenv* e, lval* a);
 lval* buildtin_var(lenv* e, lval* a, char* func);
+lval* lval_single(lenv* e, lval* x);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_apply(lenv* e, lval* f, lval** args, int n);
+lenv* lenv_frame(lenv* e, lval* f, lval** args);
+lval* lval_tail_arg(lval* f, lval** args, int n);
 lval* lval_lambda(lval* formals, lval* body);
 lval* buildtin_lambda(lenv* e, lval* a);
+void lval_resolve(lval* formals, lval* body);
 lenv* lenv_copy(lenv* e);
 void lenv_def(lenv* e, lval* k, lval* v);
 
@@ -126,6 +312,7 @@ lval* buildtin_ne(lenv* e, lval* a);
 lval* buildtin_ord(lenv* e, lval* a, char* op);
 
 int lval_eq(lval* x, lval* y);
+unsigned lval_hash(lval* v);
 
 lval* buildtin_cmp(lenv* e, lval* a, char* op);
 
@@ -136,6 +323,7 @@ lval* lval_str(char* s);
 lval* lval_add(lval* v, lval* x);
 
 void lval_print_str(lval* v);
+void lval_print_dbl(double x);
 
 lval* lval_read_str(mpc_ast_t* t);
 
@@ -143,4 +331,107 @@ lval* buildtin_load(lenv* e, lval* a);
 
 lval* buildtin_print(lenv* e, lval* a);
 
-lval* buildtin_error(lenv* e, lval* a);
\ No newline at end of file
+lval* buildtin_error(lenv* e, lval* a);
+
+lval* lval_alloc(void);
+void lval_free(lval* v);
+lenv* lenv_alloc(void);
+void lenv_free(lenv* e);
+lval** lcell_alloc(int n);
+lval** lcell_realloc(lval** c, int n, int m);
+void lcell_free(lval** c, int n);
+int lval_traced(lval* v);
+void lgc_init(int mode);
+void lgc_track(lgc* g, int kind);
+void lgc_untrack(lgc* g);
+int lgc_collect(void);
+int lgc_collect_young(void);
+void lgc_maybe_collect(void);
+void lgc_form_begin(void);
+void lgc_form_end(void);
+lval* lgc_evacuate(lval* v);
+
+lval* buildtin_mem_stats(lenv* e, lval* a);
+
+extern int lval_depth_max;
+extern int lvm_enabled;
+lcode* lvm_compile(lval* body);
+void lvm_free(lcode* c);
+lval* lvm_exec(lenv* e, lval* body);
+ljit* lvm_jit(lval* body);
+
+extern int ljit_enabled;
+ljit* ljit_compile(lenv* top, lval* f, int* later);
+lval* ljit_run(ljit* jit, lenv* e, lval** a, int n);
+void ljit_free(ljit* jit);
+
+lvec* lvec_ref(lvec* n);
+void lvec_del(lvec* n);
+lval* lvec_nth(lval* v, int i);
+lval* lvec_conj(lval* v, lval* x);
+lval* lvec_assoc(lval* v, int i, lval* x);
+lval* lvec_slice(lval* v, int from, int to);
+lval* lvec_concat(lval* a, lval* b);
+lval* buildtin_vec(lenv* e, lval* a);
+lval* buildtin_nth(lenv* e, lval* a);
+lval* buildtin_assoc(lenv* e, lval* a);
+lval* buildtin_conj(lenv* e, lval* a);
+lval* buildtin_slice(lenv* e, lval* a);
+lval* buildtin_concat(lenv* e, lval* a);
+lval* buildtin_len(lenv* e, lval* a);
+
+lval* lbig_arith(int op, lval* x, lval* y);
+int lbig_cmp(lval* x, lval* y);
+double lbig_dbl(lval* v);
+lval* lbig_fold(lval* a, int op, int i, lval* acc);
+lval* lbig_read(char* s);
+void lbig_print(lval* v);
+
+extern int lcons_enabled;
+lval* lval_cons(lval* v);
+void lcons_forget(lval* v);
+
+lmap* lmap_ref(lmap* n);
+void lmap_del(lmap* n);
+lval* lmap_get(lval* m, lval* k);
+lval* lmap_assoc(lval* m, lval* k, lval* v);
+lval* lmap_dissoc(lval* m, lval* k);
+lval* lmap_items(lval* m, int keys);
+unsigned lmap_hash(lval* m);
+lval* buildtin_hash_map(lenv* e, lval* a);
+lval* buildtin_get(lenv* e, lval* a);
+lval* buildtin_dissoc(lenv* e, lval* a);
+lval* buildtin_keys(lenv* e, lval* a);
+
+extern int larr_simd;
+int larr_avx2(void);
+lval* lval_arr(int kind, int n);
+lval* larr_f64(lval* v);
+lval* larr_sum(lval* v);
+lval* larr_dot(lval* x, lval* y);
+lval* larr_min(lval* v, int max);
+lval* larr_add(lval* x, lval* y, int step);
+lval* larr_nth(lval* v, int i);
+int larr_eq(lval* x, lval* y);
+unsigned larr_hash(lval* v);
+void larr_print(lval* v);
+lval* buildtin_i64(lenv* e, lval* a);
+lval* buildtin_f64(lenv* e, lval* a);
+lval* buildtin_iota(lenv* e, lval* a);
+lval* buildtin_vsum(lenv* e, lval* a);
+lval* buildtin_vdot(lenv* e, lval* a);
+lval* buildtin_vmin(lenv* e, lval* a);
+lval* buildtin_vmax(lenv* e, lval* a);
+lval* buildtin_vmap_add(lenv* e, lval* a);
+
+int lmat_fits(long rows, long cols);
+lval* lval_mat(int rows, int cols);
+lval* lmat_transpose(lval* m);
+lval* lmat_mul(lval* x, lval* y);
+int lmat_eq(lval* x, lval* y);
+unsigned lmat_hash(lval* v);
+void lmat_print(lval* v);
+lval* buildtin_matrix(lenv* e, lval* a);
+lval* buildtin_mref(lenv* e, lval* a);
+lval* buildtin_transpose(lenv* e, lval* a);
+lval* buildtin_mmul(lenv* e, lval* a);
@@ -0,0 +1,373 @@
+#include "lval.h"
+
+#define LVEC_BITS 5
+#define LVEC_WIDTH (1 << LVEC_BITS)
+#define LVEC_EXTRA 2
+
+/*
+ * A node of a persistent vector: a relaxed radix balanced tree, 32 wide.
+ * Leaves (shift 0) hold values, other nodes hold the nodes below them.
+ * Nodes are never changed once shared, so vectors made from one another
+ * share every node off the path they differ on.
+ *
+ * A dense node has all its children but the last completely full, so
+ * index i is found in child i >> shift. Slicing and concatenation leave
+ * nodes that are not, which keep the cumulative sizes of their children.
+ */
+struct lvec {
+    int ref;
+    int shift;
+    int count;
+    int* sizes;
+    union {
+        lvec* kids[LVEC_WIDTH];
+        lval* items[LVEC_WIDTH];
+    };
+};
+
+static lvec* lvec_node(int shift) {
+    lvec* n = malloc(sizeof(lvec));
+    n->ref = 1;
+    n->shift = shift;
+    n->count = 0;
+    n->sizes = NULL;
+    return n;
+}
+
+lvec* lvec_ref(lvec* n) {
+    n->ref++;
+    return n;
+}
+
+void lvec_del(lvec* n) {
+    if (--n->ref > 0) { return; }
+    for (int i = 0; i < n->count; i++) {
+        if (n->shift) {
+            lvec_del(n->kids[i]);
+        } else {
+            lval_del(n->items[i]);
+        }
+    }
+    free(n->sizes);
+    free(n);
+}
+
+static int lvec_size(lvec* n) {
+    if (!n->shift) { return n->count; }
+    if (n->sizes) { return n->sizes[n->count-1]; }
+    return ((n->count - 1) << n->shift) + lvec_size(n->kids[n->count-1]);
+}
+
+/* Decides whether the internal node n is dense, or records its sizes. */
+static lvec* lvec_seal(lvec* n) {
+    free(n->sizes);
+    n->sizes = NULL;
+    if (!n->shift) { return n; }
+
+    int dense = n->kids[n->count-1]->shift == 0 || !n->kids[n->count-1]->sizes;
+    for (int i = 0; dense && i < n->count - 1; i++) {
+        dense = lvec_size(n->kids[i]) == 1 << n->shift;
+    }
+    if (dense) { return n; }
+
+    n->sizes = malloc(sizeof(int) * LVEC_WIDTH);
+    int total = 0;
+    for (int i = 0; i < n->count; i++) {
+        total += lvec_size(n->kids[i]);
+        n->sizes[i] = total;
+    }
+    return n;
+}
+
+/*
+ * Returns n ready to be changed: n itself if mine says the vector it
+ * belongs to is held once and nothing else holds n, else a copy sharing
+ * its children.
+ */
+static lvec* lvec_edit(lvec* n, int mine) {
+    if (mine && n->ref == 1) { return n; }
+    lvec* x = lvec_node(n->shift);
+    x->count = n->count;
+    for (int i = 0; i < n->count; i++) {
+        if (n->shift) {
+            x->kids[i] = lvec_ref(n->kids[i]);
+        } else {
+            x->items[i] = lval_ref(n->items[i]);
+        }
+    }
+    if (n->sizes) {
+        x->sizes = malloc(sizeof(int) * LVEC_WIDTH);
+        memcpy(x->sizes, n->sizes, sizeof(int) * n->count);
+    }
+    return x;
+}
+
+/* Returns the child of n holding index *i, making *i relative to it. */
+static int lvec_child(lvec* n, int* i) {
+    int k = *i >> n->shift;
+    if (n->sizes) {
+        while (n->sizes[k] <= *i) { k++; }
+        if (k > 0) { *i -= n->sizes[k-1]; }
+    } else {
+        *i -= k << n->shift;
+    }
+    return k;
+}
+
+lval* lvec_nth(lval* v, int i) {
+    lvec* n = v->vec;
+    while (n->shift) {
+        n = n->kids[lvec_child(n, &i)];
+    }
+    return n->items[i];
+}
+
+static lvec* lvec_set(lvec* n, int i, lval* x, int mine) {
+    lvec* c = lvec_edit(n, mine);
+    if (!c->shift) {
+        lval_del(c->items[i]);
+        c->items[i] = x;
+        return c;
+    }
+    int k = lvec_child(c, &i);
+    lvec* kid = lvec_set(c->kids[k], i, x, c == n);
+    if (kid != c->kids[k]) {
+        lvec_del(c->kids[k]);
+        c->kids[k] = kid;
+    }
+    return c;
+}
+
+/* A path of new nodes down from shift to a leaf holding only x. */
+static lvec* lvec_path(int shift, lval* x) {
+    lvec* n = lvec_node(shift);
+    n->count = 1;
+    if (shift) {
+        n->kids[0] = lvec_path(shift - 5, x);
+    } else {
+        n->items[0] = x;
+    }
+    return n;
+}
+
+/* Appends x below n, or returns NULL if the rightmost path is full. */
+static lvec* lvec_push(lvec* n, lval* x, int mine) {
+    if (!n->shift) {
+        if (n->count == LVEC_WIDTH) { return NULL; }
+        lvec* c = lvec_edit(n, mine);
+        c->items[c->count++] = x;
+        return c;
+    }
+
+    lvec* kid = lvec_push(n->kids[n->count-1], x, mine && n->ref == 1);
+    if (!kid && n->count == LVEC_WIDTH) { return NULL; }
+
+    lvec* c = lvec_edit(n, mine);
+    if (kid) {
+        if (kid != c->kids[c->count-1]) {
+            lvec_del(c->kids[c->count-1]);
+            c->kids[c->count-1] = kid;
+        }
+        if (c->sizes) { c->sizes[c->count-1]++; }
+    } else {
+        c->kids[c->count++] = lvec_path(n->shift - 5, x);
+        if (c->sizes) { c->sizes[c->count-1] = c->sizes[c->count-2] + 1; }
+    }
+    return c;
+}
+
+/*
+ * Gives v the tree rooted at root in place of its own, or a new vector
+ * when v is shared. Roots left with a single child are dropped.
+ */
+static lval* lvec_result(lval* v, lvec* root, int count) {
+    if (v->ref == 1) {
+        if (v->vec && v->vec != root) { lvec_del(v->vec); }
+    } else {
+        lval_del(v);
+        v = lval_vec();
+    }
+    while (root && root->shift && root->count == 1) {
+        lvec* kid = lvec_ref(root->kids[0]);
+        lvec_del(root);
+        root = kid;
+    }
+    v->vec = root;
+    v->vcount = count;
+    return v;
+}
+
+lval* lvec_conj(lval* v, lval* x) {
+    lvec* root;
+    if (!v->vec) {
+        root = lvec_path(0, x);
+    } else {
+        root = lvec_push(v->vec, x, v->ref == 1);
+        if (!root) {
+            root = lvec_node(v->vec->shift + 5);
+            root->count = 2;
+            root->kids[0] = lvec_ref(v->vec);
+            root->kids[1] = lvec_path(v->vec->shift, x);
+            lvec_seal(root);
+        }
+    }
+    return lvec_result(v, root, v->vcount + 1);
+}
+
+lval* lvec_assoc(lval* v, int i, lval* x) {
+    return lvec_result(v, lvec_set(v->vec, i, x, v->ref == 1), v->vcount);
+}
+
+/* The part of n from index from up to, not including, to. */
+static lvec* lvec_cut(lvec* n, int from, int to) {
+    lvec* c = lvec_node(n->shift);
+    if (!n->shift) {
+        for (int i = from; i < to; i++) {
+            c->items[c->count++] = lval_ref(n->items[i]);
+        }
+        return c;
+    }
+
+    int f = from;
+    int t = to - 1;
+    int kf = lvec_child(n, &f);
+    int kt = lvec_child(n, &t);
+    for (int k = kf; k <= kt; k++) {
+        lvec* kid = n->kids[k];
+        int size = lvec_size(kid);
+        int lo = k == kf ? f : 0;
+        int hi = k == kt ? t + 1 : size;
+        c->kids[c->count++] = lo == 0 && hi == size ? lvec_ref(kid) : lvec_cut(kid, lo, hi);
+    }
+    return lvec_seal(c);
+}
+
+lval* lvec_slice(lval* v, int from, int to) {
+    if (from == 0 && to == v->vcount) { return v; }
+    return lvec_result(v, from == to ? NULL : lvec_cut(v->vec, from, to), to - from);
+}
+
+/* Puts n nodes, all with the given shift, under one or two new nodes. */
+static lvec* lvec_split(lvec** kids, int n, int shift) {
+    lvec* p = lvec_node(shift + 10);
+    for (int i = 0; i < n; i += LVEC_WIDTH) {
+        lvec* c = lvec_node(shift + 5);
+        for (int j = i; j < n && j < i + LVEC_WIDTH; j++) {
+            c->kids[c->count++] = kids[j];
+        }
+        p->kids[p->count++] = lvec_seal(c);
+    }
+    return lvec_seal(p);
+}
+
+/*
+ * Plans how to pack the children of the n nodes in all into fewer nodes,
+ * storing how many each new node gets in plan and returning how many new
+ * nodes there are. Nodes are left alone once there are at most
+ * LVEC_EXTRA more than the fewest that could hold every child; until
+ * then the first node that is not full is spread over the ones after it.
+ */
+static int lvec_plan(lvec** all, int n, int* plan) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        plan[i] = all[i]->count;
+        total += plan[i];
+    }
+
+    int least = (total + LVEC_WIDTH - 1) / LVEC_WIDTH;
+    int i = 0;
+    while (n > least + LVEC_EXTRA) {
+        while (plan[i] == LVEC_WIDTH) { i++; }
+        int rest = plan[i];
+        while (rest > 0) {
+            int k = rest + plan[i+1] < LVEC_WIDTH ? rest + plan[i+1] : LVEC_WIDTH;
+            rest += plan[i+1] - k;
+            plan[i] = k;
+            i++;
+        }
+        for (int j = i; j < n - 1; j++) { plan[j] = plan[j+1]; }
+        n--;
+        i--;
+    }
+    return n;
+}
+
+/*
+ * Makes the m nodes of plan out of the children of all, in order.
+ * A node that comes out the same as one in all is shared.
+ */
+static void lvec_pack(lvec** all, int* plan, int m, lvec** out) {
+    int k = 0;
+    int from = 0;
+    for (int i = 0; i < m; i++) {
+        if (from == 0 && plan[i] == all[k]->count) {
+            out[i] = lvec_ref(all[k++]);
+            continue;
+        }
+
+        lvec* c = lvec_node(all[k]->shift);
+        while (c->count < plan[i]) {
+            lvec* n = all[k];
+            for (; from < n->count && c->count < plan[i]; from++) {
+                if (n->shift) {
+                    c->kids[c->count++] = lvec_ref(n->kids[from]);
+                } else {
+                    c->items[c->count++] = lval_ref(n->items[from]);
+                }
+            }
+            if (from == n->count) {
+                k++;
+                from = 0;
+            }
+        }
+        out[i] = lvec_seal(c);
+    }
+}
+
+/*
+ * Concatenates l and r into a node one level above the taller of them,
+ * with one or two children, following the RRB-tree concatenation of
+ * Bagwell and Rompf. The trees are joined along the seam between them
+ * from the bottom up, and at every level the nodes meeting there are
+ * repacked by lvec_plan, so the height stays logarithmic whichever side
+ * is added to. The rest of both trees is shared.
+ */
+static lvec* lvec_merge(lvec* l, lvec* r) {
+    if (!l->shift && !r->shift) {
+        lvec* p = lvec_node(5);
+        p->count = 2;
+        p->kids[0] = lvec_ref(l);
+        p->kids[1] = lvec_ref(r);
+        return lvec_seal(p);
+    }
+
+    int shift = l->shift > r->shift ? l->shift : r->shift;
+    lvec* mid = lvec_merge(l->shift == shift ? l->kids[l->count-1] : l,
+                           r->shift == shift ? r->kids[0] : r);
+
+    lvec* all[2 * LVEC_WIDTH + 2];
+    int n = 0;
+    if (l->shift == shift) {
+        for (int i = 0; i < l->count - 1; i++) { all[n++] = l->kids[i]; }
+    }
+    for (int i = 0; i < mid->count; i++) { all[n++] = mid->kids[i]; }
+    if (r->shift == shift) {
+        for (int i = 1; i < r->count; i++) { all[n++] = r->kids[i]; }
+    }
+
+    int plan[2 * LVEC_WIDTH + 2];
+    lvec* kids[2 * LVEC_WIDTH + 2];
+    int m = lvec_plan(all, n, plan);
+    lvec_pack(all, plan, m, kids);
+    lvec_del(mid);
+
+    return lvec_split(kids, m, shift - 5);
+}
+
+lval* lvec_concat(lval* a, lval* b) {
+    if (!b->vec) { lval_del(b); return a; }
+    if (!a->vec) { lval_del(a); return b; }
+    lval* v = lvec_result(a, lvec_merge(a->vec, b->vec), a->vcount + b->vcount);
+    lval_del(b);
+    return v;
+}
@@ -0,0 +1,659 @@
+#include "lval.h"
+
+enum {
+    LVM_CONST,
+    LVM_ERROR,
+    LVM_LOOKUP,
+    LVM_SINGLE,
+    LVM_EMPTY,
+    LVM_CALL,
+    LVM_TAILCALL,
+    LVM_ADD,
+    LVM_SUB,
+    LVM_MUL,
+    LVM_DIV,
+    LVM_GT,
+    LVM_LT,
+    LVM_GE,
+    LVM_LE,
+    LVM_EQ,
+    LVM_NE,
+    LVM_IF,
+    LVM_OP2,
+    LVM_IF_OP2,
+    LVM_JUMP,
+    LVM_RETURN,
+};
+
+typedef struct {
+    void* label;
+    int op;
+    int arg;
+    int alt;
+    int fn;
+    lval* x;
+} lins;
+
+struct lcode {
+    int count;
+    int cap;
+    int depth;
+    int max;
+    lins* ins;
+    int calls;
+    ljit* jit;
+};
+
+#define LVM_STACK 32
+#define LVM_HOT 1000
+#define LVM_FRAMES 16
+
+/* A caller suspended while the VM runs the code it called. */
+typedef struct {
+    lcode* c;
+    lins* ip;
+    int base;
+    lenv* e;
+    lenv* frame;
+    lval* hold;
+} lvm_frame;
+
+int lvm_enabled = 1;
+
+/* Suspended calls across every lvm_exec, checked against lval_depth_max. */
+static int lvm_depth = 0;
+
+/* Builtins with an inline fast path, in the same order as their opcodes. */
+static struct {
+    char* name;
+    lbuildtin fn;
+} lvm_ops[] = {
+    { "+",  builtin_add },
+    { "-",  builtin_sub },
+    { "*",  builtin_mul },
+    { "/",  builtin_div },
+    { ">",  buildtin_gt },
+    { "<",  buildtin_lt },
+    { ">=", buildtin_ge },
+    { "<=", buildtin_le },
+    { "==", buildtin_eq },
+    { "!=", buildtin_ne },
+};
+
+static int lvm_emit(lcode* c, int op, int arg, lval* x) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ins = realloc(c->ins, sizeof(lins) * c->cap);
+    }
+    c->ins[c->count] = (lins){ NULL, op, arg, 0, 0, x };
+    return c->count++;
+}
+
+static void lvm_push(lcode* c, int n) {
+    c->depth += n;
+    if (c->depth > c->max) { c->max = c->depth; }
+}
+
+static int lvm_is_sym(lval* x, char* name) {
+    return lval_type(x) == LVAL_SYM && strcmp(x->sym, name) == 0;
+}
+
+/* Returns the opcode of the builtin x names, or LVM_CALL. */
+static int lvm_op(lval* x) {
+    for (int k = 0; k < sizeof(lvm_ops) / sizeof(lvm_ops[0]); k++) {
+        if (lvm_is_sym(x, lvm_ops[k].name)) { return LVM_ADD + k; }
+    }
+    return LVM_CALL;
+}
+
+/* Whether x is (op a b) for a builtin op and a, b symbols or constants. */
+static int lvm_is_op2(lval* x) {
+    if (x->count != 3 || lvm_op(x->cell[0]) == LVM_CALL) { return 0; }
+    for (int i = 1; i < 3; i++) {
+        int t = lval_type(x->cell[i]);
+        if (t == LVAL_SEXPR || t == LVAL_ERR) { return 0; }
+    }
+    return 1;
+}
+
+static void lvm_compile_sexpr(lcode* c, lval* x, int tail);
+
+/* tail is set when the value of x is the value of the whole body. */
+static void lvm_compile_expr(lcode* c, lval* x, int tail) {
+    switch (lval_type(x)) {
+        case LVAL_SYM:   lvm_emit(c, LVM_LOOKUP, 0, x);   break;
+        case LVAL_ERR:   lvm_emit(c, LVM_ERROR, 0, x);    break;
+        case LVAL_SEXPR: lvm_compile_sexpr(c, x, tail);   return;
+        default:         lvm_emit(c, LVM_CONST, 0, x);  break;
+    }
+    lvm_push(c, 1);
+}
+
+/*
+ * (if c {a} {b}) evaluates a or b in place instead of calling 'if' with
+ * both branches. Whether 'if' still names the builtin is only known once
+ * the head has been looked up, so LVM_IF falls back to an ordinary call
+ * when it does not, or when c is not a number.
+ */
+static void lvm_compile_if(lcode* c, lval* x, int tail) {
+    int i;
+    lval* cond = x->cell[1];
+    if (lval_type(cond) == LVAL_SEXPR && lvm_is_op2(cond)) {
+        i = lvm_emit(c, LVM_IF_OP2, 0, x);
+        c->ins[i].fn = lvm_op(cond->cell[0]);
+    } else {
+        lvm_compile_expr(c, x->cell[0], 0);
+        lvm_compile_expr(c, cond, 0);
+        lvm_push(c, -2);
+        i = lvm_emit(c, LVM_IF, 0, x);
+    }
+
+    lvm_compile_sexpr(c, x->cell[2], tail);
+    int j = lvm_emit(c, LVM_JUMP, 0, NULL);
+    lvm_push(c, -1);
+
+    c->ins[i].arg = c->count;
+    lvm_compile_sexpr(c, x->cell[3], tail);
+    c->ins[i].alt = c->count;
+    c->ins[j].arg = c->count;
+}
+
+/* Compiles x the way lval_eval_sexpr evaluates it, whether x is an S- or Q-Expression. */
+static void lvm_compile_sexpr(lcode* c, lval* x, int tail) {
+    if (x->count == 0) {
+        lvm_emit(c, LVM_EMPTY, 0, NULL);
+        lvm_push(c, 1);
+        return;
+    }
+    if (x->count == 1 && lval_type(x->cell[0]) == LVAL_SYM) {
+        /* (f) calls f if it names a builtin taking no arguments */
+        lvm_emit(c, LVM_SINGLE, 0, x->cell[0]);
+        lvm_push(c, 1);
+        return;
+    }
+    if (x->count == 1) {
+        lvm_compile_expr(c, x->cell[0], tail);
+        return;
+    }
+    if (x->count == 4 && lvm_is_sym(x->cell[0], "if")
+        && lval_type(x->cell[2]) == LVAL_QEXPR
+        && lval_type(x->cell[3]) == LVAL_QEXPR) {
+        lvm_compile_if(c, x, tail);
+        return;
+    }
+
+    if (lvm_is_op2(x)) {
+        int i = lvm_emit(c, LVM_OP2, 0, x);
+        c->ins[i].fn = lvm_op(x->cell[0]);
+        lvm_push(c, 1);
+        return;
+    }
+
+    int op = lvm_op(x->cell[0]);
+    if (op == LVM_CALL && tail) { op = LVM_TAILCALL; }
+    for (int i = 0; i < x->count; i++) {
+        lvm_compile_expr(c, x->cell[i], 0);
+    }
+    lvm_emit(c, op, x->count - 1, NULL);
+    lvm_push(c, 1 - x->count);
+}
+
+/*
+ * Compiles a lambda body into code for lvm_exec. Instructions point into
+ * body rather than holding references, so the code is only valid while
+ * body is unchanged; lval_unshare drops it before body is modified in
+ * place.
+ */
+lcode* lvm_compile(lval* body) {
+    lcode* c = calloc(1, sizeof(lcode));
+    lvm_compile_sexpr(c, body, 1);
+    lvm_emit(c, LVM_RETURN, 0, NULL);
+    return c;
+}
+
+void lvm_free(lcode* c) {
+    if (c->jit) { ljit_free(c->jit); }
+    free(c->ins);
+    free(c);
+}
+
+static void lvm_drop(lval** a, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!LVAL_IMMEDIATE(a[i])) { lval_del(a[i]); }
+    }
+}
+
+/*
+ * Returns a stack with room for n slots above the first used, moving it
+ * off the C stack once it outgrows local.
+ */
+static lval** lvm_reserve(lval** stack, lval** local, int used, int* cap, int n) {
+    while (*cap < used + n) { *cap *= 2; }
+    if (stack == local) {
+        lval** s = malloc(sizeof(lval*) * *cap);
+        memcpy(s, local, sizeof(lval*) * used);
+        return s;
+    }
+    return realloc(stack, sizeof(lval*) * *cap);
+}
+
+/* Calls a[0] with the n values after it, consuming all of them. */
+static lval* lvm_call(lenv* e, lval** a, int n) {
+    lval* f = a[0];
+    if (lval_type(f) != LVAL_FUN) {
+        lval* err = lval_err(
+            "S-Expression starts with incorrect type. "
+            "Got %s, Expected %s.",
+            ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+        lvm_drop(a, n + 1);
+        return err;
+    }
+
+    if (!f->buildtin) {
+        lval* x = lval_apply(e, f, a + 1, n);
+        lvm_drop(a + 1, n);
+        return x;
+    }
+
+    lval* v = lval_sexpr();
+    v->count = n;
+    v->cell = lcell_alloc(n);
+    memcpy(v->cell, a + 1, sizeof(lval*) * n);
+    return lval_call(e, f, v);
+}
+
+/*
+ * Applies an arithmetic or comparison builtin to numbers directly. Any
+ * case the builtin would treat differently (a redefined operator, a
+ * non-number, division by zero, a wrong argument count, a result too
+ * big for a long) goes through
+ * the builtin itself, so errors match the tree-walker.
+ */
+static lval* lvm_arith(lenv* e, int op, lval** a, int n) {
+    lval* f = a[0];
+    if (lval_type(f) != LVAL_FUN || f->buildtin != lvm_ops[op - LVM_ADD].fn) {
+        return lvm_call(e, a, n);
+    }
+    for (int i = 1; i <= n; i++) {
+        if (lval_type(a[i]) != LVAL_NUM) { return lvm_call(e, a, n); }
+    }
+    if (op >= LVM_GT && n != 2) { return lvm_call(e, a, n); }
+
+    long r = lval_long(a[1]);
+    switch (op) {
+        case LVM_ADD:
+            for (int i = 2; i <= n; i++) {
+                if (__builtin_add_overflow(r, lval_long(a[i]), &r)) { return lvm_call(e, a, n); }
+            }
+            break;
+        case LVM_SUB:
+            if (n == 1) {
+                if (r == LONG_MIN) { return lvm_call(e, a, n); }
+                r = -r;
+            }
+            for (int i = 2; i <= n; i++) {
+                if (__builtin_sub_overflow(r, lval_long(a[i]), &r)) { return lvm_call(e, a, n); }
+            }
+            break;
+        case LVM_MUL:
+            for (int i = 2; i <= n; i++) {
+                if (__builtin_mul_overflow(r, lval_long(a[i]), &r)) { return lvm_call(e, a, n); }
+            }
+            break;
+        case LVM_DIV:
+            for (int i = 2; i <= n; i++) {
+                if (lval_long(a[i]) == 0) { return lvm_call(e, a, n); }
+            }
+            for (int i = 2; i <= n; i++) {
+                if (r == LONG_MIN && lval_long(a[i]) == -1) { return lvm_call(e, a, n); }
+                r /= lval_long(a[i]);
+            }
+            break;
+        case LVM_GT: r = r >  lval_long(a[2]); break;
+        case LVM_LT: r = r <  lval_long(a[2]); break;
+        case LVM_GE: r = r >= lval_long(a[2]); break;
+        case LVM_LE: r = r <= lval_long(a[2]); break;
+        case LVM_EQ: r = r == lval_long(a[2]); break;
+        case LVM_NE: r = r != lval_long(a[2]); break;
+    }
+
+    lvm_drop(a, n + 1);
+    return lval_num(r);
+}
+
+static lval* lvm_operand(lenv* e, lval* x) {
+    return lval_type(x) == LVAL_SYM ? lenv_get(e, x) : lval_ref(x);
+}
+
+/*
+ * Evaluates (op a b) in one step, with a and b symbols or constants, so
+ * the common (+ x 1) or (< n 2) costs one dispatch instead of four.
+ */
+static lval* lvm_op2(lenv* e, int fn, lval* x) {
+    lval* a[3];
+    a[0] = lenv_get(e, x->cell[0]);
+    if (lval_type(a[0]) == LVAL_ERR) { return a[0]; }
+    a[1] = lvm_operand(e, x->cell[1]);
+    if (lval_type(a[1]) == LVAL_ERR) { lvm_drop(a, 1); return a[1]; }
+    a[2] = lvm_operand(e, x->cell[2]);
+    if (lval_type(a[2]) == LVAL_ERR) { lvm_drop(a, 2); return a[2]; }
+    return lvm_arith(e, fn, a, 2);
+}
+
+#define LVM_NEXT goto *(i = ip++)->label
+
+/* Returns the code for x, compiling and threading it on first use. */
+static lcode* lvm_code(lval* x, void** labels) {
+    if (!x->code) {
+        x->code = lvm_compile(x);
+        for (int k = 0; k < x->code->count; k++) {
+            x->code->ins[k].label = labels[x->code->ins[k].op];
+        }
+    }
+    return x->code;
+}
+
+ljit* lvm_jit(lval* body) {
+    return body->code ? body->code->jit : NULL;
+}
+
+/*
+ * Runs a call to the lambda f as native code once its body has been
+ * called LVM_HOT times, or returns NULL for the VM to run it.
+ */
+static lval* lvm_native(lenv* e, lval* f, lval** a, int n, void** labels) {
+    if (!ljit_enabled) { return NULL; }
+
+    lcode* c = lvm_code(f->body, labels);
+    if (!c->jit) {
+        if (c->calls == LVM_HOT || ++c->calls < LVM_HOT) { return NULL; }
+        int later;
+        c->jit = ljit_compile(e->top, f, &later);
+        if (!c->jit) {
+            if (later) { c->calls = 0; }
+            return NULL;
+        }
+    }
+    return ljit_run(c->jit, e, a, n);
+}
+
+/*
+ * Evaluates a lambda body in e, compiling it on first use. An error
+ * anywhere in the body is its result, just as lval_eval_sexpr returns
+ * the first error among its children.
+ *
+ * Dispatch is direct threaded: once compiled, every instruction holds
+ * the address of its handler, and each handler jumps straight to the
+ * next one.
+ */
+lval* lvm_exec(lenv* e, lval* body) {
+    static void* labels[] = {
+        [LVM_CONST]    = &&op_const,
+        [LVM_ERROR]    = &&op_error,
+        [LVM_LOOKUP]   = &&op_lookup,
+        [LVM_SINGLE]   = &&op_single,
+        [LVM_EMPTY]    = &&op_empty,
+        [LVM_CALL]     = &&op_call,
+        [LVM_TAILCALL] = &&op_tailcall,
+        [LVM_ADD]      = &&op_arith,
+        [LVM_SUB]      = &&op_arith,
+        [LVM_MUL]      = &&op_arith,
+        [LVM_DIV]      = &&op_arith,
+        [LVM_GT]       = &&op_arith,
+        [LVM_LT]       = &&op_arith,
+        [LVM_GE]       = &&op_arith,
+        [LVM_LE]       = &&op_arith,
+        [LVM_EQ]       = &&op_arith,
+        [LVM_NE]       = &&op_arith,
+        [LVM_IF]       = &&op_if,
+        [LVM_OP2]      = &&op_op2,
+        [LVM_IF_OP2]   = &&op_if_op2,
+        [LVM_JUMP]     = &&op_jump,
+        [LVM_RETURN]   = &&op_return,
+    };
+
+    lgc_maybe_collect();
+
+    lcode* c = lvm_code(body, labels);
+
+    lval* local[LVM_STACK];
+    lval** stack = local;
+    int cap = LVM_STACK;
+    if (c->max > cap) {
+        stack = lvm_reserve(stack, local, 0, &cap, c->max);
+    }
+
+    lvm_frame flocal[LVM_FRAMES];
+    lvm_frame* frames = flocal;
+    int fcap = LVM_FRAMES;
+    int nf = 0;
+
+    lval** sp = stack;
+    int base = 0;
+    lins* ip = c->ins;
+    lins* i;
+    lval* x;
+    lval* f;
+    lval* cond;
+
+    /* the frame and expression of the running call, which this loop owns */
+    lenv* frame = NULL;
+    lval* hold = NULL;
+
+    LVM_NEXT;
+
+op_const:
+    *sp++ = lval_ref(i->x);
+    LVM_NEXT;
+
+op_error:
+    x = lval_ref(i->x);
+    goto fail;
+
+op_lookup:
+    x = lenv_get(e, i->x);
+    if (lval_type(x) == LVAL_ERR) { goto fail; }
+    *sp++ = x;
+    LVM_NEXT;
+
+op_single:
+    x = lval_single(e, lenv_get(e, i->x));
+    if (lval_type(x) == LVAL_ERR) { goto fail; }
+    *sp++ = x;
+    LVM_NEXT;
+
+op_empty:
+    *sp++ = lval_sexpr();
+    LVM_NEXT;
+
+/*
+ * A call to a lambda, or to 'if' or 'eval', suspends the caller in a
+ * heap frame and runs the code it would evaluate in this same loop, so
+ * deep recursion grows the heap rather than the C stack.
+ */
+op_call: {
+    sp -= i->arg + 1;
+    f = sp[0];
+
+    lval* next = NULL;
+    if (lval_type(f) == LVAL_FUN && f->buildtin) {
+        next = lval_tail_arg(f, sp + 1, i->arg);
+    } else if (lval_type(f) == LVAL_FUN && i->arg == f->formals->count) {
+        x = lvm_native(e, f, sp + 1, i->arg, labels);
+        if (x) {
+            lvm_drop(sp, i->arg + 1);
+            *sp++ = x;
+            LVM_NEXT;
+        }
+        next = f->body;
+    }
+
+    if (!next) {
+        x = lvm_call(e, sp, i->arg);
+        if (lval_type(x) == LVAL_ERR) { goto fail; }
+        *sp++ = x;
+        LVM_NEXT;
+    }
+
+    if (lvm_depth == lval_depth_max) {
+        lvm_drop(sp, i->arg + 1);
+        x = lval_err("Maximum recursion depth exceeded.");
+        goto fail;
+    }
+
+    if (nf == fcap) {
+        fcap *= 2;
+        if (frames == flocal) {
+            frames = malloc(sizeof(lvm_frame) * fcap);
+            memcpy(frames, flocal, sizeof(flocal));
+        } else {
+            frames = realloc(frames, sizeof(lvm_frame) * fcap);
+        }
+    }
+    frames[nf++] = (lvm_frame){ c, ip, base, e, frame, hold };
+    lvm_depth++;
+
+    frame = f->buildtin ? NULL : lenv_frame(e, f, sp + 1);
+    if (frame) { e = frame; }
+    hold = lval_ref(next);
+    lvm_drop(sp, i->arg + 1);
+
+    c = lvm_code(next, labels);
+    base = sp - stack;
+    if (base + c->max > cap) {
+        stack = lvm_reserve(stack, local, base, &cap, c->max);
+    }
+    sp = stack + base;
+    ip = c->ins;
+
+    lgc_maybe_collect();
+    LVM_NEXT;
+}
+
+/*
+ * A call in tail position to a lambda, or to 'if' or 'eval', carries on
+ * with the code of whatever it would evaluate in place of the caller. The
+ * caller's part of the stack is empty below the call, so it is reset.
+ */
+op_tailcall: {
+    sp -= i->arg + 1;
+    f = sp[0];
+
+    lval* next = NULL;
+    if (lval_type(f) == LVAL_FUN && f->buildtin) {
+        next = lval_tail_arg(f, sp + 1, i->arg);
+        if (next) { lval_ref(next); }
+    } else if (lval_type(f) == LVAL_FUN && i->arg == f->formals->count) {
+        x = lvm_native(e, f, sp + 1, i->arg, labels);
+        if (x) {
+            lvm_drop(sp, i->arg + 1);
+            *sp++ = x;
+            LVM_NEXT;
+        }
+        lenv* n = lenv_frame(e, f, sp + 1);
+        if (frame) { lenv_del(frame); }
+        e = frame = n;
+        next = lval_ref(f->body);
+    }
+
+    if (!next) {
+        x = lvm_call(e, sp, i->arg);
+        if (lval_type(x) == LVAL_ERR) { goto fail; }
+        *sp++ = x;
+        LVM_NEXT;
+    }
+
+    lvm_drop(sp, i->arg + 1);
+    c = lvm_code(next, labels);
+    if (hold) { lval_del(hold); }
+    hold = next;
+
+    if (base + c->max > cap) {
+        stack = lvm_reserve(stack, local, base, &cap, c->max);
+    }
+    sp = stack + base;
+    ip = c->ins;
+
+    lgc_maybe_collect();
+    LVM_NEXT;
+}
+
+op_arith:
+    sp -= i->arg + 1;
+    x = lvm_arith(e, i->op, sp, i->arg);
+    if (lval_type(x) == LVAL_ERR) { goto fail; }
+    *sp++ = x;
+    LVM_NEXT;
+
+op_op2:
+    x = lvm_op2(e, i->fn, i->x);
+    if (lval_type(x) == LVAL_ERR) { goto fail; }
+    *sp++ = x;
+    LVM_NEXT;
+
+op_if:
+    sp -= 2;
+    f = sp[0];
+    cond = sp[1];
+    goto branch;
+
+op_if_op2:
+    f = lenv_get(e, i->x->cell[0]);
+    if (lval_type(f) == LVAL_ERR) { x = f; goto fail; }
+    cond = lvm_op2(e, i->fn, i->x->cell[1]);
+    if (lval_type(cond) == LVAL_ERR) { lval_del(f); x = cond; goto fail; }
+
+branch:
+    if (lval_type(f) == LVAL_FUN && f->buildtin == buildtin_if
+        && lval_type(cond) == LVAL_NUM) {
+        if (!lval_long(cond)) { ip = c->ins + i->arg; }
+        lval_del(f);
+        lval_del(cond);
+        LVM_NEXT;
+    } else {
+        lval* a[4] = { f, cond, lval_ref(i->x->cell[2]), lval_ref(i->x->cell[3]) };
+        x = lvm_call(e, a, 3);
+        if (lval_type(x) == LVAL_ERR) { goto fail; }
+        *sp++ = x;
+        ip = c->ins + i->alt;
+        LVM_NEXT;
+    }
+
+op_jump:
+    ip = c->ins + i->arg;
+    LVM_NEXT;
+
+op_return:
+    x = *--sp;
+    if (!nf) { goto done; }
+    if (hold) { lval_del(hold); }
+    if (frame) { lenv_del(frame); }
+    nf--;
+    lvm_depth--;
+    c = frames[nf].c;
+    ip = frames[nf].ip;
+    base = frames[nf].base;
+    e = frames[nf].e;
+    frame = frames[nf].frame;
+    hold = frames[nf].hold;
+    *sp++ = x;
+    LVM_NEXT;
+
+fail:
+    lvm_drop(stack, sp - stack);
+    while (nf) {
+        if (hold) { lval_del(hold); }
+        if (frame) { lenv_del(frame); }
+        nf--;
+        lvm_depth--;
+        frame = frames[nf].frame;
+        hold = frames[nf].hold;
+    }
+
+done:
+    if (stack != local) { free(stack); }
+    if (frames != flocal) { free(frames); }
+    if (hold) { lval_del(hold); }
+    if (frame) { lenv_del(frame); }
+    return x;
+}
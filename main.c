@@ -21,7 +21,7 @@ int main(int argc, char** argv) {
 
     mpca_lang(MPCA_LANG_DEFAULT,
     "                                                                   \
-        number      :   /-?[0-9]+/;                                     \
+        number      :   /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/;       \
         symbol      :   /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;               \
         string      :   /\"(\\\\.|[^\"])*\"/;                           \
         comment     :   /;[^\\r\\n]*/;                                  \
@@ -32,6 +32,38 @@ int main(int argc, char** argv) {
     ",
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
+    char* gc = getenv("LISPY_GC");
+    if (gc && strcmp(gc, "gen") == 0) {
+        lgc_init(LGC_GENERATIONAL);
+    } else if (gc && strcmp(gc, "arena") == 0) {
+        lgc_init(LGC_ARENA);
+    }
+
+    char* vm = getenv("LISPY_VM");
+    if (vm && strcmp(vm, "off") == 0) {
+        lvm_enabled = 0;
+    }
+
+    char* jit = getenv("LISPY_JIT");
+    if (jit && strcmp(jit, "off") == 0) {
+        ljit_enabled = 0;
+    }
+
+    char* cons = getenv("LISPY_CONS");
+    if (cons && strcmp(cons, "on") == 0) {
+        lcons_enabled = 1;
+    }
+
+    char* simd = getenv("LISPY_SIMD");
+    if (simd && strcmp(simd, "off") == 0) {
+        larr_simd = 0;
+    }
+
+    char* depth = getenv("LISPY_DEPTH");
+    if (depth && atoi(depth) > 0) {
+        lval_depth_max = atoi(depth);
+    }
+
     lenv* e = lenv_new();
     lenv_add_buildtins(e);
 
@@ -41,7 +73,7 @@ int main(int argc, char** argv) {
             lval* x = buildtin_load(e, args);
 
             lval_println(x);
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            if (lval_type(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
         }
     } else {
@@ -56,11 +88,13 @@ int main(int argc, char** argv) {
             
             mpc_result_t r;
             if (mpc_parse("<stdin>", input, Lispy, &r)) {
+                lgc_form_begin();
                 lval* tmp = lval_read(r.output);  
 
                 lval* result = lval_eval(e, tmp);
                 lval_println(result);
                 lval_del(result);
+                lgc_form_end();
                 mpc_ast_delete(r.output);
             } else {
                 mpc_err_print(r.error);
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs every test/*.lspy under each collector, evaluator and SIMD mode
+# and compares what it prints with the matching .expected file, or with
+# a file named like deep.LISPY_VM=off.expected for a mode known to give
+# different output. Memory is capped at LIMIT kilobytes, so a test that
+# leaks fails instead of just running slowly.
+
+LISPY=${LISPY:-./main}
+LIMIT=${LIMIT:-65536}
+
+MODES="default LISPY_GC=gen LISPY_GC=arena LISPY_VM=off LISPY_JIT=off
+       LISPY_SIMD=off LISPY_CONS=on"
+
+failed=0
+for mode in $MODES; do
+    for t in test/*.lspy; do
+        env=$mode
+        [ "$mode" = default ] && env=
+        exp=${t%.lspy}.expected
+        [ -f "${t%.lspy}.$mode.expected" ] && exp=${t%.lspy}.$mode.expected
+        out=$( (ulimit -v "$LIMIT"; env $env "$LISPY" "$t") 2>&1 )
+        if [ "$out" != "$(cat "$exp")" ]; then
+            echo "FAIL $t ($mode)"
+            echo "$out" | diff "$exp" - | head -20
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+if [ $failed -gt 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "all passed"